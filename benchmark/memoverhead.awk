@@ -1,9 +1,34 @@
 #!/usr/bin/awk -f
 
-/^data size/ { base = $4 }
+# Usage: memoverhead.awk [-v rss=1] [baseline.log] current.log
+# With two logs, prints the baseline and current overhead side by side. Arrays missing from the
+# baseline get NaN. With rss=1, the resident set size is used instead of the static size.
+
+# Arrays which allocate their storage dynamically. Their static size is meaningless, so they use the
+# memory the allocator got from the system instead, which includes the padding of aligned chunks.
+function dynamic(name) { return name == "ChunkSA" || name == "GrowableBitmapSA" }
+
+function record(bytes)
+{
+	size[file, name] = bytes / base[file]
+	if (file == ARGC - 1)
+		names[++n] = name
+}
+
+FNR == 1 { file++ }
+/^data size/ { base[file] = $4 }
 /^start/ { name = $2 }
-/^static size/ {
-	# ChunkSA does not produce useful results due to dynamic allocation.
-	if (name != "ChunkSA")
-		print name, $4 / base
+rss && /^rss/ { record($3) }
+# The virtual memory backends map their storage outside of the allocator.
+!rss && /^static size/ && !dynamic(name) && name !~ /\/Virtual$/ { record($4) }
+!rss && /^heap/ && dynamic(name) { record($3) }
+END {
+	for (i = 1; i <= n; i++)
+	{
+		name = names[i]
+		if (file == 1)
+			print name, size[1, name]
+		else
+			print name, ((1, name) in size ? size[1, name] : "NaN"), size[2, name]
+	}
 }
@@ -1,4 +1,23 @@
 #!/usr/bin/awk -f
 
+# Usage: performance.awk first.log [second.log]
+# Prints the run time of each array in seconds. With two logs, prints both times side by side for the
+# arrays which appear in both, in the order of the first log.
+
+FNR == 1 { file++ }
 /^start/ { name = $2 }
-/^end/ { print name, $3 / 1e6 }
+/^end/ {
+	time[file, name] = $3 / 1e6
+	if (file == 1)
+		names[++n] = name
+}
+END {
+	for (i = 1; i <= n; i++)
+	{
+		name = names[i]
+		if (file == 1)
+			print name, time[1, name]
+		else if ((2, name) in time)
+			print name, time[1, name], time[2, name]
+	}
+}
@@ -1,9 +1,20 @@
 #include <iostream>
 #include <chrono>
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "sparsearray.h"
@@ -24,40 +35,188 @@ struct BenchmarkResult
 {
 	int count;
 	int sum;
+	long rss; // growth of the resident set size while the array was alive
+	long heap; // growth of the memory the allocator got from the system while the array was alive
 };
 
+// Returns the resident set size of the process in bytes.
+static long resident_bytes()
+{
+	long size, resident = 0;
+	std::ifstream statm("/proc/self/statm");
+	statm >> size >> resident;
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Returns the memory the allocator got from the system, including padding and free gaps.
+static long heap_bytes()
+{
+	struct mallinfo2 info = mallinfo2();
+	return info.arena + info.hblkhd;
+}
+
+// Counts data TLB misses of this thread with a hardware performance counter.
+class TLBMissCounter
+{
+	int fd;
+
+public:
+	TLBMissCounter()
+	{
+		perf_event_attr attr = {};
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (fd >= 0)
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	~TLBMissCounter() { if (fd >= 0) close(fd); }
+
+	// Returns -1 if the counter isn't available, e.g. in a virtual machine.
+	long long Read() const
+	{
+		long long count;
+		if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+			return -1;
+		return count;
+	}
+};
+
+// ReorderingSA which defers deletions in loops until the end of the loop.
+template<typename T, size_t N>
+struct DeferredReorderingSA : ReorderingSA<T, N> { };
+
+// Loops which delete elements iterate over deleting_range(array).
 template<typename SparseArray>
-BenchmarkResult benchmark(int iterations, uint64_t seed, int addmod)
+SparseArray& deleting_range(SparseArray& array)
+{
+	return array;
+}
+
+template<typename T, size_t N>
+typename ReorderingSA<T, N>::DeferredRange deleting_range(DeferredReorderingSA<T, N>& array)
+{
+	return array.Deferred();
+}
+
+template<typename SparseArray>
+BenchmarkResult benchmark(int iterations, uint64_t seed, int addmod, bool removeif, bool batch, ThreadPool *pool)
 {
 	uint64_t r = seed;
 	auto rand = [&r]() { return r = r * 6364136223846793005 + 1442695040888963407; };
-	SparseArray array;
+	// Large arrays don't fit on the stack.
+	long rss = resident_bytes(), heap = heap_bytes();
+	std::unique_ptr<SparseArray> arrayPtr(new SparseArray);
+	SparseArray& array = *arrayPtr;
 	BenchmarkResult result = {0};
 
 	for (int i = 0; i < iterations; i++)
 	{
 		// Add new PXS periodically.
 		if (i % addmod == 0)
-			for (int j = 0; j < 10; j++)
+		{
+			C4PXS *spawned[10];
+			size_t n = 0;
+			if (batch)
+				n = array.New(10, spawned);
+			else
+				for (int j = 0; j < 10; j++)
+					if (C4PXS *npxs = array.New())
+						spawned[n++] = npxs;
+			for (size_t j = 0; j < n; j++)
 			{
-				auto npxs = array.New();
-				if (npxs)
-				{
-					npxs->Mat = 1;
-					npxs->x = 0; npxs->y = 0;
-					npxs->xdir = (int) (rand() % 100) - 50;
-					npxs->ydir = (int) (rand() % 100) - 50;
-				}
+				auto npxs = spawned[j];
+				npxs->Mat = 1;
+				npxs->x = 0; npxs->y = 0;
+				npxs->xdir = (int) (rand() % 100) - 50;
+				npxs->ydir = (int) (rand() % 100) - 50;
 			}
+		}
 		// walk through the array and do stuff
-		for (auto& pxs : array)
+		auto simulate = [](C4PXS& pxs)
 		{
 			pxs.x += pxs.xdir; pxs.y += pxs.ydir;
 			if (std::abs(pxs.x + pxs.y) > 10000)
 			{
 				pxs.Mat = C4PXS::MNone;
-				array.Delete(&pxs);
+				return true;
 			}
+			return false;
+		};
+		if (pool)
+			array.template DeterministicForEach<int>([&simulate](C4PXS& pxs, DeterministicTask<C4PXS, int>&) { return simulate(pxs); }, *pool);
+		else if (removeif)
+			array.RemoveIf(simulate);
+		else
+			for (auto& pxs : deleting_range(array))
+				if (simulate(pxs))
+					array.Delete(&pxs);
+	}
+
+	if (pool)
+	{
+		// Combined in a fixed order, so this is the same for any number of threads.
+		result = array.template DeterministicForEach<BenchmarkResult>([](C4PXS& pxs, DeterministicTask<C4PXS, BenchmarkResult>& task)
+		{
+			task.value.count++;
+			task.value.sum += pxs.x + pxs.y;
+			return false;
+		}, *pool, [](BenchmarkResult a, BenchmarkResult b)
+		{
+			a.count += b.count;
+			a.sum += b.sum;
+			return a;
+		});
+	}
+	else
+		for (auto& pxs : array)
+		{
+			result.count++;
+			result.sum += pxs.x + pxs.y;
+		}
+	result.rss = resident_bytes() - rss;
+	result.heap = heap_bytes() - heap;
+	return result;
+}
+
+// Delete-heavy variant: every iteration refills the array and then deletes about half of it.
+template<typename SparseArray>
+BenchmarkResult benchmark_delete(int iterations, uint64_t seed)
+{
+	uint64_t r = seed;
+	auto rand = [&r]() { return r = r * 6364136223846793005 + 1442695040888963407; };
+	long rss = resident_bytes(), heap = heap_bytes();
+	std::unique_ptr<SparseArray> arrayPtr(new SparseArray);
+	SparseArray& array = *arrayPtr;
+	BenchmarkResult result = {0};
+
+	for (int i = 0; i < iterations; i++)
+	{
+		C4PXS *spawned[64];
+		size_t n;
+		do
+		{
+			n = array.New(64, spawned);
+			for (size_t j = 0; j < n; j++)
+			{
+				spawned[j]->Mat = 1;
+				spawned[j]->x = spawned[j]->y = 0;
+				// The low bits of the generator are not very random.
+				spawned[j]->xdir = (int) ((rand() >> 33) % 100) - 50;
+				spawned[j]->ydir = (int) ((rand() >> 33) % 100) - 50;
+			}
+		} while (n == 64);
+		// Decide by element contents so that the result doesn't depend on iteration order.
+		for (auto& pxs : deleting_range(array))
+		{
+			if ((pxs.xdir + pxs.ydir + i) % 2 == 0)
+				array.Delete(&pxs);
+			else
+				pxs.x += pxs.xdir, pxs.y += pxs.ydir;
 		}
 	}
 
@@ -66,60 +225,319 @@ BenchmarkResult benchmark(int iterations, uint64_t seed, int addmod)
 		result.count++;
 		result.sum += pxs.x + pxs.y;
 	}
+	result.rss = resident_bytes() - rss;
+	result.heap = heap_bytes() - heap;
 	return result;
 }
 
+// Oscillating variant: the element count moves back and forth across the given chunk boundary, so
+// a chunk becomes empty and is needed again in every iteration.
+template<typename SparseArray>
+BenchmarkResult benchmark_oscillate(int iterations, uint64_t seed, size_t boundary)
+{
+	uint64_t r = seed;
+	auto rand = [&r]() { return r = r * 6364136223846793005 + 1442695040888963407; };
+	long rss = resident_bytes(), heap = heap_bytes();
+	std::unique_ptr<SparseArray> arrayPtr(new SparseArray);
+	SparseArray& array = *arrayPtr;
+	BenchmarkResult result = {0};
+
+	auto spawn = [&rand](C4PXS *pxs)
+	{
+		pxs->Mat = 1;
+		pxs->x = pxs->y = 0;
+		pxs->xdir = (int) (rand() % 100) - 50;
+		pxs->ydir = (int) (rand() % 100) - 50;
+	};
+	for (size_t i = 0; i < boundary - 5; i++)
+		spawn(array.New());
+
+	for (int i = 0; i < iterations; i++)
+	{
+		C4PXS *spawned[10];
+		size_t n = array.New(10, spawned);
+		for (size_t j = 0; j < n; j++)
+			spawn(spawned[j]);
+		// Only the new PXS move, so that allocation dominates. Deleting them in reverse order keeps
+		// ReorderingSA from moving the remaining ones.
+		for (size_t j = n; j-- > 0; )
+		{
+			result.sum += spawned[j]->xdir + spawned[j]->ydir;
+			array.Delete(spawned[j]);
+		}
+	}
+
+	for (auto& pxs : array)
+	{
+		result.count++;
+		result.sum += pxs.x + pxs.y;
+	}
+	result.rss = resident_bytes() - rss;
+	result.heap = heap_bytes() - heap;
+	return result;
+}
+
+// Multi-threaded variant: several threads spawn PXS and delete their oldest ones once they own
+// more than their share of half the array. The total work is split evenly between the threads.
+// Each thread accesses the array through a Local, which is either a reference or a Magazine. The
+// magazines are destroyed with their threads, which returns their unclaimed elements; iterating
+// before that would count them as live (default-initialized) PXS.
+template<typename SparseArray, typename Local = SparseArray&>
+BenchmarkResult benchmark_threads(int iterations, uint64_t seed, int threads, size_t capacity)
+{
+	long rss = resident_bytes(), heap = heap_bytes();
+	std::unique_ptr<SparseArray> arrayPtr(new SparseArray);
+	SparseArray& array = *arrayPtr;
+	BenchmarkResult result = {0};
+	size_t limit = capacity / 2 / threads;
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++)
+		workers.emplace_back([&array, iterations, seed, threads, limit, t]()
+		{
+			uint64_t r = seed + t;
+			auto rand = [&r]() { return r = r * 6364136223846793005 + 1442695040888963407; };
+			Local local(array);
+			std::vector<C4PXS*> owned;
+			size_t oldest = 0;
+			for (int i = 0; i < iterations / threads; i++)
+			{
+				for (int j = 0; j < 10; j++)
+				{
+					C4PXS *pxs = local.New();
+					if (!pxs) break;
+					pxs->Mat = 1;
+					pxs->x = pxs->y = 0;
+					pxs->xdir = (int) ((rand() >> 33) % 100) - 50;
+					pxs->ydir = (int) ((rand() >> 33) % 100) - 50;
+					owned.push_back(pxs);
+				}
+				for (; owned.size() - oldest > limit; oldest++)
+					local.Delete(owned[oldest]);
+			}
+		});
+	for (auto& worker : workers)
+		worker.join();
+
+	for (auto& pxs : array)
+	{
+		result.count++;
+		result.sum += pxs.xdir + pxs.ydir;
+	}
+	result.rss = resident_bytes() - rss;
+	result.heap = heap_bytes() - heap;
+	return result;
+}
+
+// Serializes New and Delete of an array with a mutex.
+template<typename SparseArray>
+class LockedSA : public SparseArray
+{
+	std::mutex lock;
+
+public:
+	C4PXS* New()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return SparseArray::New();
+	}
+
+	size_t New(size_t n, C4PXS **out)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return SparseArray::New(n, out);
+	}
+
+	void Delete(C4PXS *pxs)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		SparseArray::Delete(pxs);
+	}
+};
+
+enum class Mode { Default, DeleteHeavy, Oscillate, Threads };
+
 // Options
 static int iterations = 100000;
 static uint64_t seed = 199897253124;
 static int addmod = 1;
+static bool removeif = false;
+static bool batch = false;
+static Mode mode = Mode::Default;
+static bool tlb = false;
+// Links of the linked lists and HandleReorderingSA are 64 bit wide like pointers instead of the
+// smallest index type.
+static bool widelinks = false;
+static size_t list_size = 10000;
+static int threads = 1;
+// Size of ChunkSA's chunks, which -o oscillates around.
+static size_t chunk_size = 0;
+// Simulation threads for ParallelForEach, 0 to iterate sequentially.
+static int simulationThreads = 0;
 
-template<typename SparseArray>
+// GrowableBitmapSA limited to the same number of elements as the other arrays. Its segments divide N
+// and fill their aligned blocks like ChunkSA's chunks.
+template<typename T, size_t N, size_t SegmentSize = sa_detail::FillingChunkSize(N, sa_detail::SegmentHeaderBytes, sizeof(T), alignof(T))>
+struct LimitedGrowableBitmapSA : GrowableBitmapSA<T, SegmentSize>
+{
+	LimitedGrowableBitmapSA() : GrowableBitmapSA<T, SegmentSize>(N / SegmentSize) { }
+};
+
+template<typename SparseArray, typename Local = SparseArray&>
 static void run_benchmark(const char *name)
 {
 	std::chrono::time_point<std::chrono::high_resolution_clock> start, end;
 	std::chrono::duration<double> elapsed_seconds;
 
 	std::cout << "start " << name << std::endl;
+	// Give memory freed by the previous benchmarks back, so that it doesn't hide the heap growth.
+	malloc_trim(0);
+	TLBMissCounter tlbMisses;
 	start = std::chrono::high_resolution_clock::now();
-	auto r = benchmark<SparseArray>(iterations, seed, addmod);
+	BenchmarkResult r;
+	switch (mode)
+	{
+	case Mode::Default:
+	{
+		std::unique_ptr<ThreadPool> pool(simulationThreads ? new ThreadPool(simulationThreads) : nullptr);
+		r = benchmark<SparseArray>(iterations, seed, addmod, removeif, batch, pool.get());
+		break;
+	}
+	case Mode::DeleteHeavy: r = benchmark_delete<SparseArray>(iterations, seed); break;
+	case Mode::Oscillate: r = benchmark_oscillate<SparseArray>(iterations, seed, chunk_size); break;
+	case Mode::Threads: r = benchmark_threads<SparseArray, Local>(iterations, seed, threads, list_size); break;
+	}
 	end = std::chrono::high_resolution_clock::now();
+	long long misses = tlbMisses.Read();
 	elapsed_seconds = end - start;
 	std::cout << "end = " << std::chrono::duration_cast<std::chrono::microseconds>(elapsed_seconds).count() << " μs" << std::endl;
 	std::cout << "static size = " << sizeof(SparseArray) << " byte" << std::endl;
 	std::cout << "count = " << r.count << std::endl;
-	std::cout << "sum = " << r.sum << std::endl << std::endl;
+	std::cout << "sum = " << r.sum << std::endl;
+	std::cout << "rss = " << r.rss << " byte" << std::endl;
+	std::cout << "heap = " << r.heap << " byte" << std::endl;
+	if (tlb)
+	{
+		std::cout << "dtlb misses = ";
+		if (misses < 0)
+			std::cout << "n/a" << std::endl;
+		else
+			std::cout << misses << std::endl;
+	}
+	std::cout << std::endl;
+}
+
+// With -t, arrays with inline storage also run on huge pages for comparison.
+template<typename SparseArray>
+static void run_benchmarks(const std::string& name)
+{
+	run_benchmark<SparseArray>(name.c_str());
+	if (tlb)
+		run_benchmark<HugePageSA<SparseArray>>((name + "/HugePages").c_str());
+}
+
+// Runs the single-threaded benchmarks. Index is the link type of the arrays which link elements.
+template<size_t size, typename Index>
+static void run_arrays()
+{
+	run_benchmarks<BitmapSA<C4PXS, size>>("BitmapSA");
+	run_benchmark<BitmapSA<C4PXS, size, VirtualStorage>>("BitmapSA/Virtual");
+	run_benchmarks<ConcurrentBitmapSA<C4PXS, size>>("ConcurrentBitmapSA");
+	run_benchmarks<HierarchicalBitmapSA<C4PXS, size>>("HierarchicalBitmapSA");
+	run_benchmark<LimitedGrowableBitmapSA<C4PXS, size>>("GrowableBitmapSA");
+	run_benchmark<ChunkSA<C4PXS, size>>("ChunkSA");
+	run_benchmarks<StaticChunkSA<C4PXS, size>>("StaticChunkSA");
+	run_benchmarks<LinkedListSA<C4PXS, size, InterleavedLayout, Index>>("LinkedListSA");
+	run_benchmarks<LinkedListBitmapSA<C4PXS, size, InterleavedLayout, Index>>("LinkedListBitmapSA");
+	run_benchmarks<DoubleLinkedListSA<C4PXS, size, InterleavedLayout, Index>>("DoubleLinkedListSA");
+	run_benchmarks<LinkedListSA<C4PXS, size, SplitLayout, Index>>("LinkedListSA/Split");
+	run_benchmarks<LinkedListBitmapSA<C4PXS, size, SplitLayout, Index>>("LinkedListBitmapSA/Split");
+	run_benchmarks<DoubleLinkedListSA<C4PXS, size, SplitLayout, Index>>("DoubleLinkedListSA/Split");
+	run_benchmarks<UnorderedLinkedListSA<C4PXS, size, InterleavedLayout, Index>>("UnorderedLinkedListSA");
+	run_benchmarks<ReorderingSA<C4PXS, size>>("ReorderingSA");
+	run_benchmark<ReorderingSA<C4PXS, size, VirtualStorage>>("ReorderingSA/Virtual");
+	run_benchmarks<DeferredReorderingSA<C4PXS, size>>("ReorderingSA/Deferred");
+	run_benchmarks<HandleReorderingSA<C4PXS, size, InlineStorage, Index>>("HandleReorderingSA");
+}
+
+template<size_t size>
+static void run_all()
+{
+	std::cout << "data size = " << sizeof(C4PXS[size]) << " byte" << std::endl << std::endl;
+	chunk_size = ChunkSA<C4PXS, size>::ChunkElements;
+
+	if (mode == Mode::Threads)
+	{
+		// Scale from one thread to all cores.
+		int cores = std::max(1u, std::thread::hardware_concurrency());
+		for (threads = 1; ; threads = std::min(threads * 2, cores))
+		{
+			std::string suffix = " (" + std::to_string(threads) + " threads)";
+			run_benchmark<LockedSA<BitmapSA<C4PXS, size>>>(("BitmapSA/Mutex" + suffix).c_str());
+			run_benchmark<ConcurrentBitmapSA<C4PXS, size>>(("ConcurrentBitmapSA" + suffix).c_str());
+			run_benchmark<LockedSA<StaticChunkSA<C4PXS, size>>, Magazine<LockedSA<StaticChunkSA<C4PXS, size>>>>(("StaticChunkSA/Mutex/Magazine" + suffix).c_str());
+			run_benchmark<ConcurrentBitmapSA<C4PXS, size>, Magazine<ConcurrentBitmapSA<C4PXS, size>>>(("ConcurrentBitmapSA/Magazine" + suffix).c_str());
+			if (threads == cores)
+				break;
+		}
+		return;
+	}
+
+	if (widelinks)
+		run_arrays<size, uint64_t>();
+	else
+		run_arrays<size, sa_detail::LinkIndex<size>>();
 }
 
 int main(int argc, char **argv)
 {
-	const size_t list_size = 10000;
+	// Always use fresh mappings for large arrays, so that the RSS measurement isn't skewed by memory
+	// freed by the previous benchmark.
+	mallopt(M_MMAP_THRESHOLD, 128 * 1024);
+	// Grow the heap only as far as needed, so that its growth shows what the arrays allocated.
+	mallopt(M_TOP_PAD, 0);
 
 	int opt;
-	while ((opt = getopt(argc, argv, "l:i:s:a:")) != -1)
+	while ((opt = getopt(argc, argv, "l:i:s:a:rbdotpwj:")) != -1)
 	{
 		switch (opt)
 		{
 		// No error handling. Don't pass invalid values.
+		case 'l': list_size = std::strtoull(optarg, nullptr, 10); break;
 		case 'i': iterations = std::atoi(optarg); break;
 		case 's': seed = std::strtoull(optarg, nullptr, 10); break;
 		case 'a': addmod = std::atoi(optarg); break;
+		case 'r': removeif = true; break;
+		case 'b': batch = true; break;
+		case 'd': mode = Mode::DeleteHeavy; break;
+		case 'o': mode = Mode::Oscillate; break;
+		case 't': tlb = true; break;
+		case 'p': mode = Mode::Threads; break;
+		case 'w': widelinks = true; break;
+		case 'j': simulationThreads = std::atoi(optarg); break;
 		default: std::cerr << "Invalid option " << (char) opt << std::endl;
 		}
 	}
 	std::cout << "iterations = " << std::to_string(iterations) << std::endl;
 	std::cout << "seed = " << std::to_string(seed) << std::endl;
 	std::cout << "addmod = " << std::to_string(addmod) << std::endl;
-	std::cout << "data size = " << sizeof(C4PXS[list_size]) << " byte" << std::endl << std::endl;
-
-	run_benchmark<BitmapSA<C4PXS, list_size>>("BitmapSA");
-	run_benchmark<ChunkSA<C4PXS, list_size>>("ChunkSA");
-	run_benchmark<StaticChunkSA<C4PXS, list_size>>("StaticChunkSA");
-	run_benchmark<LinkedListSA<C4PXS, list_size>>("LinkedListSA");
-	run_benchmark<LinkedListBitmapSA<C4PXS, list_size>>("LinkedListBitmapSA");
-	run_benchmark<DoubleLinkedListSA<C4PXS, list_size>>("DoubleLinkedListSA");
-	run_benchmark<UnorderedLinkedListSA<C4PXS, list_size>>("UnorderedLinkedListSA");
-	run_benchmark<ReorderingSA<C4PXS, list_size>>("ReorderingSA");
+	std::cout << "removeif = " << removeif << std::endl;
+	std::cout << "batch = " << batch << std::endl;
+	std::cout << "mode = " << (int) mode << std::endl;
+	std::cout << "tlb = " << tlb << std::endl;
+	std::cout << "wide links = " << widelinks << std::endl;
+	std::cout << "simulation threads = " << simulationThreads << std::endl;
+
+	// The array size is a template parameter, so only a few sizes are available.
+	switch (list_size)
+	{
+	case 10000: run_all<10000>(); break;
+	case 100000: run_all<100000>(); break;
+	case 1000000: run_all<1000000>(); break;
+	default:
+		std::cerr << "Unsupported list size " << list_size << " (use 10000, 100000 or 1000000)" << std::endl;
+		return 1;
+	}
 
 	return 0;
 }
@@ -1,98 +1,1898 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SA_X86_DISPATCH 1
+#endif
+
+namespace sa_detail
+{
+	// Constructs a T in the given memory. Without arguments, this default-initializes like a plain
+	// array element would be, so New doesn't have to clear elements of trivial types.
+	template<typename T>
+	inline T* Construct(void *p)
+	{
+		return new (p) T;
+	}
+
+	template<typename T, typename... Args>
+	inline T* Construct(void *p, Args&&... args)
+	{
+		return new (p) T(std::forward<Args>(args)...);
+	}
+
+	// Moves the element at from into the unused spot to and reports the move as relocate(from, to).
+	template<typename T, typename Relocate>
+	inline void MoveElement(T *from, T *to, Relocate& relocate)
+	{
+		new (to) T(std::move(*from));
+		from->~T();
+		relocate(from, to);
+	}
+
+	// Returns the index of the first word in words[begin, end) which is not equal to value or end
+	// if there is none. This is used to find non-full or non-empty bitmap words.
+	inline size_t FindWordNotEqualScalar(const uint64_t *words, size_t begin, size_t end, uint64_t value)
+	{
+		for (size_t i = begin; i < end; i++)
+			if (words[i] != value)
+				return i;
+		return end;
+	}
+
+#ifdef SA_X86_DISPATCH
+	// Compares four words at once.
+	__attribute__((target("avx2")))
+	inline size_t FindWordNotEqualAVX2(const uint64_t *words, size_t begin, size_t end, uint64_t value)
+	{
+		const __m256i v = _mm256_set1_epi64x(value);
+		size_t i = begin;
+		for (; i + 4 <= end; i += 4)
+		{
+			__m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + i));
+			int eq = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(w, v)));
+			if (eq != 0xf)
+				return i + __builtin_ctz(~eq);
+		}
+		return FindWordNotEqualScalar(words, i, end, value);
+	}
+
+	// Compares eight words at once.
+	__attribute__((target("avx512f")))
+	inline size_t FindWordNotEqualAVX512(const uint64_t *words, size_t begin, size_t end, uint64_t value)
+	{
+		const __m512i v = _mm512_set1_epi64(value);
+		size_t i = begin;
+		for (; i + 8 <= end; i += 8)
+		{
+			__mmask8 ne = _mm512_cmpneq_epi64_mask(_mm512_loadu_si512(words + i), v);
+			if (ne)
+				return i + __builtin_ctz(ne);
+		}
+		return FindWordNotEqualScalar(words, i, end, value);
+	}
+#endif
+
+	// Bitmap of N bits with word-wise backwards search. In contrast to std::bitset, this allows
+	// finding the previous set or unset bit without testing each bit separately.
+	template<size_t N>
+	class Bitmap
+	{
+		static constexpr size_t wordsN = (N + 63) / 64;
+		uint64_t words[wordsN] = {0};
+
+		// Returns the highest bit below i in the given words (optionally inverted) or npos.
+		size_t FindPrev(size_t i, uint64_t invert) const
+		{
+			size_t w = i / 64;
+			uint64_t m = i % 64 ? (words[w] ^ invert) & (((uint64_t) 1 << i % 64) - 1) : 0;
+			while (!m)
+			{
+				if (w == 0) return npos;
+				m = words[--w] ^ invert;
+			}
+			return w*64 + 63 - __builtin_clzll(m);
+		}
+
+	public:
+		static constexpr size_t npos = ~(size_t) 0;
+
+		bool operator[](size_t i) const { return words[i / 64] >> i % 64 & 1; }
+		void set(size_t i) { words[i / 64] |= (uint64_t) 1 << i % 64; }
+		void reset(size_t i) { words[i / 64] &= ~((uint64_t) 1 << i % 64); }
+
+		// Returns the index of the lowest set bit at or after i or npos if there is none.
+		size_t FindNextSet(size_t i) const
+		{
+			if (i >= N) return npos;
+			size_t w = i / 64;
+			uint64_t m = words[w] & (~(uint64_t) 0 << i % 64);
+			while (!m)
+			{
+				if (++w == wordsN) return npos;
+				m = words[w];
+			}
+			return w*64 + __builtin_ctzll(m);
+		}
+
+		// Returns the index of the highest set bit below i or npos if there is none.
+		size_t FindPrevSet(size_t i) const { return FindPrev(i, 0); }
+		// Returns the index of the highest unset bit below i or npos if there is none.
+		size_t FindPrevUnset(size_t i) const { return FindPrev(i, ~(uint64_t) 0); }
+	};
+
+	// Returns the smallest power of two which is at least n.
+	constexpr size_t NextPowerOfTwo(size_t n)
+	{
+		size_t p = 1;
+		while (p < n)
+			p *= 2;
+		return p;
+	}
+
+	// Bytes an allocator needs next to a block it aligns. posix_memalign only costs a single aligned
+	// block if the allocation leaves this much of it free (glibc needs about 40).
+	constexpr size_t AllocatorSlack = 64;
+
+	// Returns the size of a block which starts with headerBytes, followed by one occupancy bit per
+	// element and count elements of the given size and alignment.
+	constexpr size_t BlockBytes(size_t headerBytes, size_t count, size_t size, size_t align)
+	{
+		return (headerBytes + (count + 63) / 64 * sizeof(uint64_t) + align - 1) / align * align + count * size;
+	}
+
+	// Returns the divisor of n between 256 and 4096 whose blocks use the largest share of their
+	// power-of-two alignment, or n if there is none.
+	constexpr size_t FillingChunkSize(size_t n, size_t headerBytes, size_t size, size_t align)
+	{
+		size_t best = 0, bestAlign = 0;
+		for (size_t count = 256; count <= 4096 && count <= n; count++)
+		{
+			if (n % count) continue;
+			size_t blockAlign = NextPowerOfTwo(BlockBytes(headerBytes, count, size, align) + AllocatorSlack);
+			// Compares count / blockAlign with best / bestAlign.
+			if (!best || count * bestAlign >= best * blockAlign)
+			{
+				best = count;
+				bestAlign = blockAlign;
+			}
+		}
+		return best ? best : n;
+	}
+
+	// Returns the largest number of elements which fit into a block of blockBytes together with
+	// their header and bitmap (see BlockBytes), but at least one.
+	constexpr size_t ElementsPerBlock(size_t blockBytes, size_t headerBytes, size_t size, size_t align)
+	{
+		size_t count = blockBytes / size;
+		while (count > 1 && BlockBytes(headerBytes, count, size, align) + AllocatorSlack > blockBytes)
+			count--;
+		return count ? count : 1;
+	}
+
+	// Size of GrowableBitmapSA's segment header (index and fill) in front of the bitmap.
+	constexpr size_t SegmentHeaderBytes = 2 * sizeof(size_t);
+
+	// Smallest index type for links between N list elements. The maximum value is reserved to mark
+	// the end of a list, which leaves exactly the indices 0 to N - 1 for N = 0xffff.
+	template<size_t N>
+	using LinkIndex = typename std::conditional<(N <= 0xffff), uint16_t, uint32_t>::type;
+
+	typedef size_t (*FindWordNotEqualFn)(const uint64_t *words, size_t begin, size_t end, uint64_t value);
+
+	// Picks the fastest implementation the CPU supports.
+	inline FindWordNotEqualFn SelectFindWordNotEqual()
+	{
+#ifdef SA_X86_DISPATCH
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return FindWordNotEqualAVX512;
+		if (__builtin_cpu_supports("avx2"))
+			return FindWordNotEqualAVX2;
+#endif
+		return FindWordNotEqualScalar;
+	}
+
+	inline size_t FindWordNotEqual(const uint64_t *words, size_t begin, size_t end, uint64_t value)
+	{
+		static const FindWordNotEqualFn impl = SelectFindWordNotEqual();
+		return impl(words, begin, end, value);
+	}
+
+	// Returns a small number which is different for each thread, in order of first use.
+	inline size_t ThreadSlot()
+	{
+		static std::atomic<size_t> next(0);
+		thread_local size_t slot = next++;
+		return slot;
+	}
+}
+
+// Fixed set of threads for ParallelForEach. Run splits the tasks evenly between the threads. A thread
+// which runs out of tasks steals from the end of another thread's range.
+class ThreadPool
+{
+	// Remaining tasks of one thread. Padded so that threads don't share cache lines.
+	struct Queue
+	{
+		std::mutex lock;
+		size_t begin = 0, end = 0;
+		char padding[64];
+	};
+
+	size_t size;
+	std::unique_ptr<Queue[]> queues;
+	std::vector<std::thread> threads;
+	std::function<void(size_t, size_t)> job;
+
+	std::mutex lock;
+	std::condition_variable start, done;
+	size_t generation = 0, running = 0;
+	bool stop = false;
+
+	bool Take(size_t thread, size_t& task)
+	{
+		for (size_t i = 0; i < size; i++)
+		{
+			Queue& queue = queues[(thread + i) % size];
+			std::lock_guard<std::mutex> guard(queue.lock);
+			if (queue.begin < queue.end)
+			{
+				// Take from the front of the own range, steal from the back of others.
+				task = i ? --queue.end : queue.begin++;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void Work(size_t thread)
+	{
+		size_t task;
+		while (Take(thread, task))
+			job(task, thread);
+	}
+
+	void Loop(size_t thread)
+	{
+		size_t seen = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				start.wait(guard, [&]() { return stop || generation != seen; });
+				if (stop)
+					return;
+				seen = generation;
+			}
+			Work(thread);
+			std::lock_guard<std::mutex> guard(lock);
+			if (!--running)
+				done.notify_one();
+		}
+	}
+
+public:
+	// The calling thread of Run counts as one of the threads.
+	explicit ThreadPool(size_t size = std::thread::hardware_concurrency())
+		: size(std::max<size_t>(size, 1)), queues(new Queue[this->size])
+	{
+		for (size_t i = 1; i < this->size; i++)
+			threads.emplace_back(&ThreadPool::Loop, this, i);
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stop = true;
+		}
+		start.notify_all();
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	size_t Size() const { return size; }
+
+	// Calls fn(task, thread) for all tasks in [0, tasks) and waits until all of them are done. thread
+	// is the index of the calling thread in [0, Size()).
+	template<typename Fn>
+	void Run(size_t tasks, Fn fn)
+	{
+		job = fn;
+		for (size_t i = 0; i < size; i++)
+		{
+			std::lock_guard<std::mutex> guard(queues[i].lock);
+			queues[i].begin = tasks * i / size;
+			queues[i].end = tasks * (i + 1) / size;
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running = size - 1;
+			generation++;
+		}
+		start.notify_all();
+		Work(0);
+		std::unique_lock<std::mutex> guard(lock);
+		done.wait(guard, [&]() { return !running; });
+	}
+};
+
+// State of one task of DeterministicForEach.
+template<typename T, typename Acc>
+struct DeterministicTask
+{
+	Acc value = Acc();
+	// Elements to delete and to add after the pass.
+	std::vector<T*> deleted;
+	std::vector<T> spawned;
+
+	void Spawn(const T& el) { spawned.push_back(el); }
+};
+
+namespace sa_detail
+{
+	// Runs task(i, deleted) for all i in [0, tasks) on the pool, where deleted collects the elements
+	// to delete on the current thread. Afterwards, deletes them from the highest address down, so
+	// that arrays which move elements on Delete don't invalidate the remaining pointers.
+	template<typename T, typename Task, typename Delete>
+	void ParallelPass(ThreadPool& pool, size_t tasks, Task task, Delete del)
+	{
+		std::vector<std::vector<T*>> deleted(pool.Size());
+		pool.Run(tasks, [&](size_t i, size_t thread) { task(i, deleted[thread]); });
+		std::vector<T*> all;
+		for (auto& d : deleted)
+			all.insert(all.end(), d.begin(), d.end());
+		std::sort(all.begin(), all.end(), std::greater<T*>());
+		for (T *el : all)
+			del(el);
+	}
+
+	// Runs task(i, state) for all i in [0, tasks) with a separate state for each task. The tasks
+	// must be in memory order. Then deletes the collected elements in reverse memory order (see
+	// above) and adds the new ones in order, so that the result only depends on the tasks.
+	template<typename T, typename Acc, typename Task, typename Combine, typename Delete, typename Add>
+	Acc DeterministicPass(ThreadPool& pool, size_t tasks, Task task, Combine combine, Delete del, Add add)
+	{
+		std::vector<DeterministicTask<T, Acc>> states(tasks);
+		pool.Run(tasks, [&](size_t i, size_t) { task(i, states[i]); });
+		Acc result = Acc();
+		for (auto& state : states)
+			result = combine(result, state.value);
+		for (size_t i = tasks; i-- > 0; )
+			for (size_t j = states[i].deleted.size(); j-- > 0; )
+				del(states[i].deleted[j]);
+		for (auto& state : states)
+			for (const T& el : state.spawned)
+				add(el);
+		return result;
+	}
+}
+
+// Storage backends for BitmapSA and ReorderingSA. Array<T, N> provides raw memory for N elements.
+// The arrays call Commit(n) before using elements below n and Release(n) when no element at or above
+// n is in use anymore.
+
+// Stores the elements inside the array object.
+struct InlineStorage
+{
+	template<typename T, size_t N>
+	class Array
+	{
+		// Elements are only constructed when they are in use.
+		union { T data[N]; };
+
+	public:
+		Array() { }
+		~Array() { }
+
+		T* Data() { return data; }
+		const T* Data() const { return data; }
+		void Commit(size_t) { }
+		void Release(size_t) { }
+	};
+};
+
+// Reserves address space for all elements up front, but only commits memory up to the highest used
+// element. When the tail of the array becomes empty, its pages are given back to the kernel.
+struct VirtualStorage
+{
+	template<typename T, size_t N>
+	class Array
+	{
+		// Memory is committed and released in steps of this many bytes.
+		static constexpr size_t Granule = 64 * 1024;
+		static constexpr size_t Bytes = (sizeof(T) * N + Granule - 1) / Granule * Granule;
+
+		T *data;
+		size_t committed = 0; // in bytes
+
+		static size_t RoundUp(size_t n) { return (n * sizeof(T) + Granule - 1) / Granule * Granule; }
+
+	public:
+		Array()
+		{
+			void *p = mmap(nullptr, Bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (p == MAP_FAILED)
+				throw std::bad_alloc();
+			data = static_cast<T*>(p);
+		}
+
+		~Array()
+		{
+			munmap(data, Bytes);
+		}
+
+		Array(const Array&) = delete;
+		Array& operator=(const Array&) = delete;
+
+		T* Data() { return data; }
+		const T* Data() const { return data; }
+
+		void Commit(size_t n)
+		{
+			if (n * sizeof(T) <= committed)
+				return;
+			size_t end = RoundUp(n);
+			if (mprotect(reinterpret_cast<char*>(data) + committed, end - committed, PROT_READ | PROT_WRITE))
+				throw std::bad_alloc();
+			committed = end;
+		}
+
+		void Release(size_t n)
+		{
+			// Keep one granule of slack so that oscillating around a granule boundary doesn't cause a
+			// system call every time.
+			size_t end = RoundUp(n) + Granule;
+			if (end >= committed)
+				return;
+			char *p = reinterpret_cast<char*>(data) + end;
+			madvise(p, committed - end, MADV_DONTNEED);
+			mprotect(p, committed - end, PROT_NONE);
+			committed = end;
+		}
+	};
+};
+
+namespace sa_detail
+{
+	constexpr size_t HugePageSize = 2 * 1024 * 1024;
+
+	// Allocates memory aligned to a huge page and asks the kernel to back it with transparent huge
+	// pages. Small allocations and systems without THP get normal pages.
+	inline void* AllocateHugePages(size_t size)
+	{
+		if (size < HugePageSize)
+			return ::operator new(size);
+		size_t bytes = (size + HugePageSize - 1) / HugePageSize * HugePageSize;
+		// Over-allocate and cut off the unaligned parts.
+		void *p = mmap(nullptr, bytes + HugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			throw std::bad_alloc();
+		char *begin = static_cast<char*>(p);
+		char *aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(begin) + HugePageSize - 1) & ~(HugePageSize - 1));
+		if (aligned != begin)
+			munmap(begin, aligned - begin);
+		if (aligned + bytes != begin + bytes + HugePageSize)
+			munmap(aligned + bytes, begin + HugePageSize - aligned);
+#ifdef MADV_HUGEPAGE
+		// Failure just means normal pages.
+		madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+		return aligned;
+	}
+
+	inline void FreeHugePages(void *p, size_t size)
+	{
+		if (size < HugePageSize)
+			return ::operator delete(p);
+		munmap(p, (size + HugePageSize - 1) / HugePageSize * HugePageSize);
+	}
+}
+
+// Wrapper which places an array on transparent huge pages when it is allocated with new. This
+// reduces dTLB misses for large arrays with inline storage, e.g. HugePageSA<BitmapSA<T, 1000000>>.
+template<typename SA>
+class HugePageSA : public SA
+{
+public:
+	using SA::SA;
+
+	static void* operator new(size_t size) { return sa_detail::AllocateHugePages(size); }
+	static void operator delete(void *p, size_t size) { sa_detail::FreeHugePages(p, size); }
+};
+
+// Default relocation callback for ReorderingSA and Compact, which doesn't do anything.
+struct NoRelocation
+{
+	template<typename T>
+	void operator()(T*, T*) { }
+};
+
+template<typename T, size_t N, typename Storage = InlineStorage>
+class BitmapSA
+{
+	typename Storage::template Array<T, N> storage;
+	static constexpr size_t maskN = (N + 63) / 64;
+	uint64_t mask[maskN] = {0};
+	// All mask words before freeWord are full, all mask words starting at usedWords are empty.
+	size_t freeWord = 0, usedWords = 0;
+	// CompactStep continues its search for elements to move here. There are no used elements between
+	// the first unused spot and compactFrom.
+	size_t compactFrom = 0;
+
+	// Updates usedWords after mask[i] became empty.
+	void ShrinkUsedWords(size_t i)
+	{
+		if (i + 1 == usedWords)
+		{
+			while (usedWords && !mask[usedWords - 1])
+				usedWords--;
+			storage.Release(usedWords * 64);
+		}
+	}
+
+	// Parallel passes split the array into tasks of 64 mask words. The split doesn't depend on the
+	// number of threads.
+	size_t ParallelTasks() const { return (usedWords + 63) / 64; }
+
+	template<typename Fn>
+	void ForEachInTask(size_t task, Fn fn)
+	{
+		for (size_t i = task * 64; i < usedWords && i < task * 64 + 64; i++)
+			for (uint64_t m = mask[i]; m; m &= m - 1)
+				fn(storage.Data()[i*64 + __builtin_ctzll(m)]);
+	}
+
+public:
+	BitmapSA() { }
+
+	~BitmapSA()
+	{
+		if (!std::is_trivially_destructible<T>::value)
+			for (T& el : *this)
+				el.~T();
+	}
+
+	T* New()
+	{
+		return Emplace();
+	}
+
+	// Constructs a new element with the given arguments in an unused spot. Returns nullptr if the
+	// array is full.
+	template<typename... Args>
+	T* Emplace(Args&&... args)
+	{
+		size_t i = freeWord = sa_detail::FindWordNotEqual(mask, freeWord, maskN, ~(uint64_t) 0);
+		if (i < maskN)
+		{
+			size_t j = __builtin_ctzll(~mask[i]);
+			size_t idx = i*64 + j;
+			if (idx >= N) return nullptr;
+			mask[i] |= (uint64_t) 1 << j;
+			if (i >= usedWords)
+				usedWords = i + 1;
+			storage.Commit(idx + 1);
+			return sa_detail::Construct<T>(&storage.Data()[idx], std::forward<Args>(args)...);
+		}
+		return nullptr;
+	}
+
+	// Claims up to n unused elements in memory order and stores pointers to them in out. Returns the
+	// number of claimed elements.
+	size_t New(size_t n, T **out)
+	{
+		size_t count = 0;
+		for (size_t i = freeWord; count < n; i++)
+		{
+			// All words we skipped or took elements from before are full now.
+			i = freeWord = sa_detail::FindWordNotEqual(mask, i, maskN, ~(uint64_t) 0);
+			if (i >= maskN) break;
+			uint64_t m = ~mask[i];
+			if (i == maskN - 1 && N % 64)
+				m &= ((uint64_t) 1 << N % 64) - 1;
+			// Claim the whole word at once unless we need fewer elements.
+			size_t want = n - count;
+			if ((size_t) __builtin_popcountll(m) > want)
+			{
+				uint64_t rest = m;
+				for (size_t k = 0; k < want; k++)
+					rest &= rest - 1;
+				m &= ~rest;
+			}
+			mask[i] |= m;
+			if (m && i >= usedWords)
+				usedWords = i + 1;
+			if (m)
+				storage.Commit(i*64 + 64 - __builtin_clzll(m));
+			for (; m; m &= m - 1)
+				out[count++] = sa_detail::Construct<T>(&storage.Data()[i*64 + __builtin_ctzll(m)]);
+		}
+		return count;
+	}
+
+	void Delete(T *el)
+	{
+		size_t idx = el - storage.Data();
+		assert(idx < N);
+		size_t i = idx / 64, j = idx % 64;
+		el->~T();
+		mask[i] &= ~((uint64_t) 1 << j);
+		if (i < freeWord)
+			freeWord = i;
+		if (idx < compactFrom)
+			compactFrom = idx;
+		if (!mask[i])
+			ShrinkUsedWords(i);
+	}
+
+	// Calls pred for all used elements in memory order and deletes the elements for which it returns
+	// true. pred must not add or delete elements itself.
+	template<typename Pred>
+	void RemoveIf(Pred pred)
+	{
+		for (size_t i = 0; ; i++)
+		{
+			i = sa_detail::FindWordNotEqual(mask, i, usedWords, 0);
+			if (i >= usedWords) break;
+			uint64_t removed = 0;
+			for (uint64_t m = mask[i]; m; m &= m - 1)
+			{
+				size_t j = __builtin_ctzll(m);
+				if (pred(storage.Data()[i*64 + j]))
+				{
+					storage.Data()[i*64 + j].~T();
+					removed |= (uint64_t) 1 << j;
+				}
+			}
+			mask[i] &= ~removed;
+			if (removed && i < freeWord)
+				freeWord = i;
+			if (removed && i*64 < compactFrom)
+				compactFrom = i*64;
+		}
+		ShrinkUsedWords(usedWords - 1);
+	}
+
+	// Returns the share of unused spots before the last used element, from 0 to 1. Iteration has to
+	// skip these, so Compact pays off when this is high.
+	double Fragmentation() const
+	{
+		size_t used = 0;
+		for (size_t i = 0; i < usedWords; i++)
+			used += __builtin_popcountll(mask[i]);
+		if (!used) return 0;
+		size_t span = usedWords*64 - __builtin_clzll(mask[usedWords - 1]);
+		return 1 - (double) used / span;
+	}
+
+	// Moves the used elements into the lowest unused spots, keeping their order, and calls
+	// relocate(from, to) for each move. Returns the number of moved elements. Pointers to moved
+	// elements become invalid, so this must not be called during iteration.
+	template<typename Relocate = NoRelocation>
+	size_t Compact(Relocate relocate = Relocate())
+	{
+		// All words before freeWord are full already.
+		if (freeWord >= usedWords) return 0;
+		T *data = storage.Data();
+		size_t to = freeWord * 64, moved = 0;
+		for (size_t i = freeWord; i < usedWords; i++)
+			for (uint64_t m = mask[i]; m; m &= m - 1)
+			{
+				size_t from = i*64 + __builtin_ctzll(m);
+				if (from != to)
+				{
+					sa_detail::MoveElement(&data[from], &data[to], relocate);
+					moved++;
+				}
+				to++;
+			}
+		// Now exactly the first to spots are used.
+		for (size_t i = freeWord; i < usedWords; i++)
+			mask[i] = i < to / 64 ? ~(uint64_t) 0 : i == to / 64 ? ((uint64_t) 1 << to % 64) - 1 : 0;
+		freeWord = to / 64;
+		usedWords = (to + 63) / 64;
+		storage.Release(usedWords * 64);
+		return moved;
+	}
+
+	// Like Compact, but moves at most maxMoves elements and continues where the last call stopped.
+	// The array stays consistent between calls, so this can run once per frame. New, Delete and
+	// RemoveIf may be called in between; deletions before the current position restart the search.
+	// Returns the number of moved elements. Fewer than maxMoves means that the array is compact.
+	template<typename Relocate = NoRelocation>
+	size_t CompactStep(size_t maxMoves, Relocate relocate = Relocate())
+	{
+		T *data = storage.Data();
+		size_t moved = 0;
+		for (; moved < maxMoves; moved++)
+		{
+			size_t i = freeWord = sa_detail::FindWordNotEqual(mask, freeWord, usedWords, ~(uint64_t) 0);
+			if (i >= usedWords) break;
+			size_t to = i*64 + __builtin_ctzll(~mask[i]);
+
+			// Move the first used element after to.
+			size_t from = std::max(to + 1, compactFrom), w = from / 64;
+			uint64_t m = w < usedWords ? mask[w] & (~(uint64_t) 0 << from % 64) : 0;
+			if (!m)
+			{
+				w = sa_detail::FindWordNotEqual(mask, w + 1, usedWords, 0);
+				if (w >= usedWords) break;
+				m = mask[w];
+			}
+			from = w*64 + __builtin_ctzll(m);
+			sa_detail::MoveElement(&data[from], &data[to], relocate);
+			mask[i] |= (uint64_t) 1 << to % 64;
+			mask[w] &= ~((uint64_t) 1 << from % 64);
+			compactFrom = from + 1;
+			if (!mask[w])
+				ShrinkUsedWords(w);
+		}
+		return moved;
+	}
+
+	// Runs CompactStep until the array is compact or the time budget is used up. Returns the number
+	// of moved elements.
+	template<typename Relocate = NoRelocation>
+	size_t CompactFor(std::chrono::microseconds budget, Relocate relocate = Relocate())
+	{
+		auto deadline = std::chrono::steady_clock::now() + budget;
+		size_t moved = 0, step;
+		// Reading the clock costs more than a move, so check it only every 64 moves.
+		do
+			moved += step = CompactStep<Relocate&>(64, relocate);
+		while (step == 64 && std::chrono::steady_clock::now() < deadline);
+		return moved;
+	}
+
+	// Calls fn for all used elements on the threads of pool and deletes the elements for which it
+	// returns true afterwards. fn is called concurrently for different elements and must not add or
+	// delete elements itself.
+	template<typename Fn>
+	void ParallelForEach(Fn fn, ThreadPool& pool)
+	{
+		sa_detail::ParallelPass<T>(pool, ParallelTasks(), [&](size_t task, std::vector<T*>& deleted)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el)) deleted.push_back(&el); });
+		}, [this](T *el) { Delete(el); });
+	}
+
+	// Like ParallelForEach, but the outcome doesn't depend on the number of threads. fn(el, task) may
+	// update task.value and Spawn new elements. Returns the values of all tasks combined in order.
+	template<typename Acc, typename Fn, typename Combine = std::plus<Acc>>
+	Acc DeterministicForEach(Fn fn, ThreadPool& pool, Combine combine = Combine())
+	{
+		return sa_detail::DeterministicPass<T, Acc>(pool, ParallelTasks(), [&](size_t task, DeterministicTask<T, Acc>& state)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el, state)) state.deleted.push_back(&el); });
+		}, combine, [this](T *el) { Delete(el); }, [this](const T& el) { Emplace(el); });
+	}
+
+	template<typename Ti, typename SA = BitmapSA>
+	class Iterator : public std::iterator<std::forward_iterator_tag, Ti>
+	{
+		SA *array;
+		size_t el; // current element
+		uint64_t cur; // remaining used bits in the mask word of el
+
+		// Moves to the first used element in mask word i whose bit is set in m.
+		Iterator& next(size_t i, uint64_t m)
+		{
+			if (!m)
+			{
+				// Skip all empty mask words at once. There are no used elements after usedWords.
+				size_t end = array->usedWords;
+				i = sa_detail::FindWordNotEqual(array->mask, i + 1, end, 0);
+				if (i >= end)
+				{
+					array = nullptr;
+					el = 0;
+					cur = 0;
+					return *this;
+				}
+				m = array->mask[i];
+			}
+			el = i*64 + __builtin_ctzll(m);
+			cur = m & (m - 1);
+			return *this;
+		}
+
+	public:
+		Iterator(SA *array) : array(array), el(0), cur(0)
+		{
+			if (array)
+				next(0, array->mask[0]);
+		}
+
+		Iterator& operator++()
+		{
+			assert(array);
+			return next(el / 64, cur);
+		}
+
+		bool operator==(Iterator other) { return array == other.array && el == other.el; }
+		bool operator!=(Iterator other) { return !(*this == other); }
+		Ti& operator*() const { assert(el < N); return array->storage.Data()[el]; }
+	};
+
+	Iterator<T> begin() { return Iterator<T>(this); }
+	Iterator<T> end() { return Iterator<T>(nullptr); }
+	Iterator<const T, const BitmapSA> begin() const { return Iterator<const T, const BitmapSA>(this); }
+	Iterator<const T, const BitmapSA> end() const { return Iterator<const T, const BitmapSA>(nullptr); }
+};
+
+// BitmapSA variant which allows calling New and Delete from multiple threads at the same time.
+// Mask words are atomic: New claims bits with fetch_or and Delete clears them with fetch_and. To keep
+// threads from fighting over the same words, each thread starts its search at its own hint, spread
+// over the array initially. Iteration and RemoveIf must not run concurrently with other operations.
+template<typename T, size_t N, size_t Hints = 16>
+class ConcurrentBitmapSA
+{
+	// Elements are only constructed when they are in use.
+	union { T data[N]; };
+	static constexpr size_t maskN = (N + 63) / 64;
+	std::atomic<uint64_t> mask[maskN] = {};
+	// All mask words starting at usedWords are empty. Only RemoveIf makes it smaller.
+	std::atomic<size_t> usedWords;
+	// Mask word each thread slot starts searching at. Padded so that threads don't share cache lines
+	// (without alignas, which operator new doesn't respect before C++17).
+	struct Hint { std::atomic<size_t> word; char padding[64 - sizeof(std::atomic<size_t>)]; };
+	Hint hints[Hints];
+
+	static uint64_t ValidBits(size_t i)
+	{
+		return i == maskN - 1 && N % 64 ? ((uint64_t) 1 << N % 64) - 1 : ~(uint64_t) 0;
+	}
+
+	void GrowUsedWords(size_t i)
+	{
+		size_t used = usedWords.load(std::memory_order_relaxed);
+		while (used <= i && !usedWords.compare_exchange_weak(used, i + 1, std::memory_order_relaxed))
+			;
+	}
+
+	// Claims up to want free bits in mask word i and returns them.
+	uint64_t Claim(size_t i, size_t want)
+	{
+		uint64_t m = mask[i].load(std::memory_order_relaxed);
+		for (;;)
+		{
+			uint64_t free = ~m & ValidBits(i);
+			if (!free)
+				return 0;
+			uint64_t rest = free;
+			for (size_t k = 0; k < want && rest; k++)
+				rest &= rest - 1;
+			free &= ~rest;
+			// Other threads may have taken some of the bits in the meantime.
+			m = mask[i].fetch_or(free, std::memory_order_acq_rel);
+			if (free & ~m)
+			{
+				GrowUsedWords(i);
+				return free & ~m;
+			}
+		}
+	}
+
+	// Claims up to n elements and constructs them with args, which are only passed for n == 1.
+	template<typename... Args>
+	size_t Spawn(size_t n, T **out, Args&&... args)
+	{
+		std::atomic<size_t>& hint = hints[sa_detail::ThreadSlot() % Hints].word;
+		size_t start = hint.load(std::memory_order_relaxed), count = 0, i = start;
+		for (size_t k = 0; k < maskN && count < n; k++)
+		{
+			i = start + k < maskN ? start + k : start + k - maskN;
+			for (uint64_t m = Claim(i, n - count); m; m &= m - 1)
+				out[count++] = sa_detail::Construct<T>(&data[i*64 + __builtin_ctzll(m)], std::forward<Args>(args)...);
+		}
+		if (i != start)
+			hint.store(i, std::memory_order_relaxed);
+		return count;
+	}
+
+	// Parallel passes split the array into tasks of 64 mask words. The split doesn't depend on the
+	// number of threads.
+	size_t ParallelTasks() const { return (usedWords.load(std::memory_order_relaxed) + 63) / 64; }
+
+	template<typename Fn>
+	void ForEachInTask(size_t task, Fn fn)
+	{
+		size_t used = usedWords.load(std::memory_order_relaxed);
+		for (size_t i = task * 64; i < used && i < task * 64 + 64; i++)
+			for (uint64_t m = mask[i].load(std::memory_order_relaxed); m; m &= m - 1)
+				fn(data[i*64 + __builtin_ctzll(m)]);
+	}
+
+public:
+	ConcurrentBitmapSA() : usedWords(0)
+	{
+		for (size_t h = 0; h < Hints; h++)
+			hints[h].word.store(h * maskN / Hints, std::memory_order_relaxed);
+	}
+
+	~ConcurrentBitmapSA()
+	{
+		if (!std::is_trivially_destructible<T>::value)
+			for (T& el : *this)
+				el.~T();
+	}
+
+	T* New()
+	{
+		return Emplace();
+	}
+
+	// Constructs a new element with the given arguments in an unused spot. Returns nullptr if the
+	// array is full.
+	template<typename... Args>
+	T* Emplace(Args&&... args)
+	{
+		T *el;
+		return Spawn(1, &el, std::forward<Args>(args)...) ? el : nullptr;
+	}
+
+	// Claims up to n unused elements and stores pointers to them in out. Returns the number of claimed
+	// elements. The search starts at the hint of the calling thread and wraps around at the end.
+	size_t New(size_t n, T **out)
+	{
+		return Spawn(n, out);
+	}
+
+	void Delete(T *el)
+	{
+		size_t idx = el - data;
+		assert(idx < N);
+		size_t i = idx / 64, j = idx % 64;
+		el->~T();
+		mask[i].fetch_and(~((uint64_t) 1 << j), std::memory_order_acq_rel);
+		// Refill holes in memory order, but only move the hint of the calling thread.
+		std::atomic<size_t>& hint = hints[sa_detail::ThreadSlot() % Hints].word;
+		if (i < hint.load(std::memory_order_relaxed))
+			hint.store(i, std::memory_order_relaxed);
+	}
+
+	// Calls pred for all used elements in memory order and deletes the elements for which it returns
+	// true. pred must not add or delete elements itself.
+	template<typename Pred>
+	void RemoveIf(Pred pred)
+	{
+		std::atomic<size_t>& hint = hints[sa_detail::ThreadSlot() % Hints].word;
+		size_t used = usedWords.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < used; i++)
+		{
+			uint64_t removed = 0;
+			for (uint64_t m = mask[i].load(std::memory_order_relaxed); m; m &= m - 1)
+			{
+				size_t j = __builtin_ctzll(m);
+				if (pred(data[i*64 + j]))
+				{
+					data[i*64 + j].~T();
+					removed |= (uint64_t) 1 << j;
+				}
+			}
+			if (removed)
+			{
+				mask[i].fetch_and(~removed, std::memory_order_relaxed);
+				if (i < hint.load(std::memory_order_relaxed))
+					hint.store(i, std::memory_order_relaxed);
+			}
+		}
+		while (used && !mask[used - 1].load(std::memory_order_relaxed))
+			used--;
+		usedWords.store(used, std::memory_order_relaxed);
+	}
+
+	// Calls fn for all used elements on the threads of pool and deletes the elements for which it
+	// returns true afterwards. fn is called concurrently for different elements and must not add or
+	// delete elements itself.
+	template<typename Fn>
+	void ParallelForEach(Fn fn, ThreadPool& pool)
+	{
+		sa_detail::ParallelPass<T>(pool, ParallelTasks(), [&](size_t task, std::vector<T*>& deleted)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el)) deleted.push_back(&el); });
+		}, [this](T *el) { Delete(el); });
+	}
+
+	// Like ParallelForEach, but the outcome doesn't depend on the number of threads. fn(el, task) may
+	// update task.value and Spawn new elements. Returns the values of all tasks combined in order.
+	template<typename Acc, typename Fn, typename Combine = std::plus<Acc>>
+	Acc DeterministicForEach(Fn fn, ThreadPool& pool, Combine combine = Combine())
+	{
+		return sa_detail::DeterministicPass<T, Acc>(pool, ParallelTasks(), [&](size_t task, DeterministicTask<T, Acc>& state)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el, state)) state.deleted.push_back(&el); });
+		}, combine, [this](T *el) { Delete(el); }, [this](const T& el) { Emplace(el); });
+	}
+
+	template<typename Ti, typename SA = ConcurrentBitmapSA>
+	class Iterator : public std::iterator<std::forward_iterator_tag, Ti>
+	{
+		SA *array;
+		size_t el; // current element
+		uint64_t cur; // remaining used bits in the mask word of el
+
+		// Moves to the first used element in mask word i whose bit is set in m.
+		Iterator& next(size_t i, uint64_t m)
+		{
+			size_t end = array->usedWords.load(std::memory_order_relaxed);
+			while (!m)
+			{
+				if (++i >= end)
+				{
+					array = nullptr;
+					el = 0;
+					cur = 0;
+					return *this;
+				}
+				m = array->mask[i].load(std::memory_order_relaxed);
+			}
+			el = i*64 + __builtin_ctzll(m);
+			cur = m & (m - 1);
+			return *this;
+		}
+
+	public:
+		Iterator(SA *array) : array(array), el(0), cur(0)
+		{
+			if (array)
+				next(0, array->mask[0].load(std::memory_order_relaxed));
+		}
+
+		Iterator& operator++()
+		{
+			assert(array);
+			return next(el / 64, cur);
+		}
+
+		bool operator==(Iterator other) { return array == other.array && el == other.el; }
+		bool operator!=(Iterator other) { return !(*this == other); }
+		Ti& operator*() const { assert(el < N); return array->data[el]; }
+	};
+
+	Iterator<T> begin() { return Iterator<T>(this); }
+	Iterator<T> end() { return Iterator<T>(nullptr); }
+	Iterator<const T, const ConcurrentBitmapSA> begin() const { return Iterator<const T, const ConcurrentBitmapSA>(this); }
+	Iterator<const T, const ConcurrentBitmapSA> end() const { return Iterator<const T, const ConcurrentBitmapSA>(nullptr); }
+};
+
+// Per-thread cache of free elements of a shared array. The magazine claims Size elements at once
+// with the array's batch New (a few atomic operations for ConcurrentBitmapSA) and then hands them out
+// without touching the array. The claimed elements are already part of the array: until Flush
+// returns the unused ones, they are default-initialized placeholders which iteration, RemoveIf and
+// compaction treat like any other element. Refills must be thread-safe, so arrays other than
+// ConcurrentBitmapSA need a lock around their batch New and Delete.
+template<typename SA, size_t Size = 64>
+class Magazine
+{
+	typedef typename std::remove_reference<decltype(*std::declval<SA&>().begin())>::type T;
+
+	SA& array;
+	T *slots[Size];
+	// slots[next, count) are claimed but not handed out yet.
+	size_t next = 0, count = 0;
+
+public:
+	explicit Magazine(SA& array) : array(array) { }
+	~Magazine() { Flush(); }
+
+	Magazine(const Magazine&) = delete;
+	Magazine& operator=(const Magazine&) = delete;
+
+	T* New()
+	{
+		if (next == count)
+		{
+			next = 0;
+			count = array.New(Size, slots);
+			if (!count)
+				return nullptr;
+		}
+		return slots[next++];
+	}
+
+	template<typename... Args>
+	T* Emplace(Args&&... args)
+	{
+		T *el = New();
+		if (!el)
+			return nullptr;
+		el->~T();
+		return sa_detail::Construct<T>(el, std::forward<Args>(args)...);
+	}
+
+	void Delete(T *el)
+	{
+		array.Delete(el);
+	}
+
+	// Returns all unused elements to the array.
+	void Flush()
+	{
+		// Backwards, so that the array can shrink its used range right away.
+		while (count > next)
+			array.Delete(slots[--count]);
+		next = count = 0;
+	}
+};
+
+template<typename T, size_t N>
+class HierarchicalBitmapSA
+{
+	// Elements are only constructed when they are in use.
+	union { T data[N]; };
+	static constexpr size_t maskN = (N + 63) / 64;
+	static constexpr size_t summaryN = (maskN + 63) / 64;
+	static constexpr size_t topN = (summaryN + 63) / 64;
+	uint64_t mask[maskN] = {0};
+	// Bit k of freeSummary[s] is set if mask[s*64 + k] has a free bit, bit k of usedSummary[s] is
+	// set if it has a used bit.
+	uint64_t freeSummary[summaryN];
+	uint64_t usedSummary[summaryN] = {0};
+	// The same one level up: bit k of freeTop[t] and usedTop[t] is set if freeSummary[t*64 + k] and
+	// usedSummary[t*64 + k] are not zero, respectively.
+	uint64_t freeTop[topN];
+	uint64_t usedTop[topN] = {0};
+	// All summary words before freeSummaryWord have no free bit, all summary words starting at
+	// usedSummaryWords have no used bit.
+	size_t freeSummaryWord = 0, usedSummaryWords = 0;
+
+	// Mask of the bits in mask[i] which correspond to array elements.
+	static constexpr uint64_t ValidBits(size_t i)
+	{
+		return i == maskN - 1 && N % 64 ? ((uint64_t) 1 << N % 64) - 1 : ~(uint64_t) 0;
+	}
+
+	// Returns the index of the first summary word at or after s whose bit is set in top or summaryN
+	// if there is none. Runs of zero top words are skipped like BitmapSA skips mask words.
+	static size_t NextSummaryWord(const uint64_t *top, size_t s)
+	{
+		size_t t = s / 64;
+		if (t >= topN) return summaryN;
+		uint64_t m = top[t] & (~(uint64_t) 0 << s % 64);
+		if (!m)
+		{
+			t = sa_detail::FindWordNotEqual(top, t + 1, topN, 0);
+			if (t >= topN) return summaryN;
+			m = top[t];
+		}
+		return t*64 + __builtin_ctzll(m);
+	}
+
+	// Returns the index of the first non-empty mask word at or after i or maskN if there is none.
+	size_t NextUsedWord(size_t i) const
+	{
+		size_t s = i / 64;
+		if (s >= usedSummaryWords) return maskN;
+		uint64_t m = usedSummary[s] & (~(uint64_t) 0 << i % 64);
+		if (!m)
+		{
+			s = NextSummaryWord(usedTop, s + 1);
+			if (s >= usedSummaryWords) return maskN;
+			m = usedSummary[s];
+		}
+		return s*64 + __builtin_ctzll(m);
+	}
+
+	// Sets bit k of freeSummary[s] and updates the top level.
+	void MarkFree(size_t s, size_t k)
+	{
+		if (!freeSummary[s])
+			freeTop[s / 64] |= (uint64_t) 1 << s % 64;
+		freeSummary[s] |= (uint64_t) 1 << k;
+	}
+
+	// Clears bit k of freeSummary[s] and updates the top level.
+	void MarkFull(size_t s, size_t k)
+	{
+		freeSummary[s] &= ~((uint64_t) 1 << k);
+		if (!freeSummary[s])
+			freeTop[s / 64] &= ~((uint64_t) 1 << s % 64);
+	}
+
+	// Sets bit k of usedSummary[s] and updates the top level.
+	void MarkUsed(size_t s, size_t k)
+	{
+		if (!usedSummary[s])
+			usedTop[s / 64] |= (uint64_t) 1 << s % 64;
+		usedSummary[s] |= (uint64_t) 1 << k;
+		if (s >= usedSummaryWords)
+			usedSummaryWords = s + 1;
+	}
+
+	// Clears bit k of usedSummary[s] and updates the top level and usedSummaryWords.
+	void MarkEmpty(size_t s, size_t k)
+	{
+		usedSummary[s] &= ~((uint64_t) 1 << k);
+		if (usedSummary[s])
+			return;
+		usedTop[s / 64] &= ~((uint64_t) 1 << s % 64);
+		if (s + 1 != usedSummaryWords)
+			return;
+		// Find the last summary word with a used bit through the top level.
+		for (size_t t = s / 64 + 1; t-- > 0; )
+			if (usedTop[t])
+			{
+				usedSummaryWords = t*64 + 64 - __builtin_clzll(usedTop[t]);
+				return;
+			}
+		usedSummaryWords = 0;
+	}
+
+	// Parallel passes have one task per summary word.
+	size_t ParallelTasks() const { return usedSummaryWords; }
+
+	template<typename Fn>
+	void ForEachInTask(size_t s, Fn fn)
+	{
+		for (uint64_t words = usedSummary[s]; words; words &= words - 1)
+		{
+			size_t i = s*64 + __builtin_ctzll(words);
+			for (uint64_t m = mask[i]; m; m &= m - 1)
+				fn(data[i*64 + __builtin_ctzll(m)]);
+		}
+	}
+
+public:
+	HierarchicalBitmapSA()
+	{
+		// All mask words start out with free bits.
+		for (size_t s = 0; s < summaryN; s++)
+			freeSummary[s] = s == summaryN - 1 && maskN % 64 ? ((uint64_t) 1 << maskN % 64) - 1 : ~(uint64_t) 0;
+		for (size_t t = 0; t < topN; t++)
+			freeTop[t] = t == topN - 1 && summaryN % 64 ? ((uint64_t) 1 << summaryN % 64) - 1 : ~(uint64_t) 0;
+	}
+
+	~HierarchicalBitmapSA()
+	{
+		if (!std::is_trivially_destructible<T>::value)
+			for (T& el : *this)
+				el.~T();
+	}
+
+	T* New()
+	{
+		return Emplace();
+	}
+
+	// Constructs a new element with the given arguments in an unused spot. Returns nullptr if the
+	// array is full.
+	template<typename... Args>
+	T* Emplace(Args&&... args)
+	{
+		size_t s = freeSummaryWord = NextSummaryWord(freeTop, freeSummaryWord);
+		if (s == summaryN)
+			return nullptr;
+		size_t k = __builtin_ctzll(freeSummary[s]);
+		size_t i = s*64 + k;
+		size_t j = __builtin_ctzll(~mask[i]);
+		mask[i] |= (uint64_t) 1 << j;
+		MarkUsed(s, k);
+		if (mask[i] == ValidBits(i))
+			MarkFull(s, k);
+		return sa_detail::Construct<T>(&data[i*64 + j], std::forward<Args>(args)...);
+	}
+
+	// Claims up to n unused elements in memory order and stores pointers to them in out. Returns the
+	// number of claimed elements.
+	size_t New(size_t n, T **out)
+	{
+		size_t count = 0;
+		size_t s = NextSummaryWord(freeTop, freeSummaryWord);
+		for (; s < summaryN && count < n; s = NextSummaryWord(freeTop, s))
+		{
+			size_t k = __builtin_ctzll(freeSummary[s]);
+			size_t i = s*64 + k;
+			uint64_t m = ~mask[i] & ValidBits(i);
+			// Claim the whole word at once unless we need fewer elements.
+			size_t want = n - count;
+			if ((size_t) __builtin_popcountll(m) > want)
+			{
+				uint64_t rest = m;
+				for (size_t c = 0; c < want; c++)
+					rest &= rest - 1;
+				m &= ~rest;
+			}
+			mask[i] |= m;
+			MarkUsed(s, k);
+			if (mask[i] == ValidBits(i))
+				MarkFull(s, k);
+			for (; m; m &= m - 1)
+				out[count++] = sa_detail::Construct<T>(&data[i*64 + __builtin_ctzll(m)]);
+		}
+		freeSummaryWord = s;
+		return count;
+	}
+
+	void Delete(T *el)
+	{
+		size_t idx = el - data;
+		assert(idx < N);
+		size_t i = idx / 64, j = idx % 64;
+		size_t s = i / 64, k = i % 64;
+		assert(mask[i] & ((uint64_t) 1 << j));
+		el->~T();
+		mask[i] &= ~((uint64_t) 1 << j);
+		MarkFree(s, k);
+		if (s < freeSummaryWord)
+			freeSummaryWord = s;
+		if (!mask[i])
+			MarkEmpty(s, k);
+	}
+
+	// Calls pred for all used elements in memory order and deletes the elements for which it returns
+	// true. pred must not add or delete elements itself.
+	template<typename Pred>
+	void RemoveIf(Pred pred)
+	{
+		for (size_t i = NextUsedWord(0); i < maskN; i = NextUsedWord(i + 1))
+		{
+			uint64_t removed = 0;
+			for (uint64_t m = mask[i]; m; m &= m - 1)
+			{
+				size_t j = __builtin_ctzll(m);
+				if (pred(data[i*64 + j]))
+				{
+					data[i*64 + j].~T();
+					removed |= (uint64_t) 1 << j;
+				}
+			}
+			if (removed)
+			{
+				size_t s = i / 64, k = i % 64;
+				mask[i] &= ~removed;
+				MarkFree(s, k);
+				if (s < freeSummaryWord)
+					freeSummaryWord = s;
+				if (!mask[i])
+					MarkEmpty(s, k);
+			}
+		}
+	}
 
-template<typename T, size_t N>
-class BitmapSA
+	// Calls fn for all used elements on the threads of pool and deletes the elements for which it
+	// returns true afterwards. fn is called concurrently for different elements and must not add or
+	// delete elements itself.
+	template<typename Fn>
+	void ParallelForEach(Fn fn, ThreadPool& pool)
+	{
+		sa_detail::ParallelPass<T>(pool, ParallelTasks(), [&](size_t task, std::vector<T*>& deleted)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el)) deleted.push_back(&el); });
+		}, [this](T *el) { Delete(el); });
+	}
+
+	// Like ParallelForEach, but the outcome doesn't depend on the number of threads. fn(el, task) may
+	// update task.value and Spawn new elements. Returns the values of all tasks combined in order.
+	template<typename Acc, typename Fn, typename Combine = std::plus<Acc>>
+	Acc DeterministicForEach(Fn fn, ThreadPool& pool, Combine combine = Combine())
+	{
+		return sa_detail::DeterministicPass<T, Acc>(pool, ParallelTasks(), [&](size_t task, DeterministicTask<T, Acc>& state)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el, state)) state.deleted.push_back(&el); });
+		}, combine, [this](T *el) { Delete(el); }, [this](const T& el) { Emplace(el); });
+	}
+
+	template<typename Ti, typename SA = HierarchicalBitmapSA>
+	class Iterator : public std::iterator<std::forward_iterator_tag, Ti>
+	{
+		SA *array;
+		size_t el; // current element in data
+		uint64_t cur; // remaining used bits in the mask word of el
+
+		// Moves to the first used element in mask word i whose bit is set in m. The search through
+		// the summaries is kept out of line, so that the common case inlines into loops.
+		Iterator& next(size_t i, uint64_t m)
+		{
+			if (!m)
+				return nextWord(i);
+			el = i*64 + __builtin_ctzll(m);
+			cur = m & (m - 1);
+			return *this;
+		}
+
+		// Moves to the first used element after mask word i.
+		__attribute__((noinline)) Iterator& nextWord(size_t i)
+		{
+			i = array->NextUsedWord(i + 1);
+			if (i >= maskN)
+			{
+				array = nullptr;
+				el = 0;
+				cur = 0;
+				return *this;
+			}
+			return next(i, array->mask[i]);
+		}
+
+	public:
+		Iterator(SA *array) : array(array), el(0), cur(0)
+		{
+			if (array)
+				next(0, array->mask[0]);
+		}
+
+		Iterator& operator++()
+		{
+			assert(array);
+			return next(el / 64, cur);
+		}
+
+		bool operator==(Iterator other) { return array == other.array && el == other.el; }
+		bool operator!=(Iterator other) { return !(*this == other); }
+		Ti& operator*() const { assert(el < N); return array->data[el]; }
+	};
+
+	Iterator<T> begin() { return Iterator<T>(this); }
+	Iterator<T> end() { return Iterator<T>(nullptr); }
+	Iterator<const T, const HierarchicalBitmapSA> begin() const { return Iterator<const T, const HierarchicalBitmapSA>(this); }
+	Iterator<const T, const HierarchicalBitmapSA> end() const { return Iterator<const T, const HierarchicalBitmapSA>(nullptr); }
+};
+
+// BitmapSA variant without a fixed size. Elements live in segments of SegmentSize elements which are
+// allocated on demand and never move. Trailing segments are released when they become empty.
+// By default, a segment fills a 64 KiB block.
+template<typename T, size_t SegmentSize = sa_detail::ElementsPerBlock(1 << 16, sa_detail::SegmentHeaderBytes, sizeof(T), alignof(T))>
+class GrowableBitmapSA
 {
-	T data[N];
-	static constexpr size_t maskN = (N + 63) / 64;
-	uint64_t mask[maskN] = {0};
+	static constexpr size_t maskN = (SegmentSize + 63) / 64;
+
+	// Segments are aligned to their size rounded up to a power of two, so Delete finds an
+	// element's segment by masking its address. The allocator can't use the rest of the aligned
+	// block, so SegmentSize should fill it (see sa_detail::ElementsPerBlock).
+	struct Segment
+	{
+		size_t index, fill;
+		uint64_t mask[maskN];
+		// Elements are only constructed when they are in use.
+		union { T data[SegmentSize]; };
+
+		Segment() { }
+		~Segment() { }
+	};
+	static constexpr size_t SegmentAlign = sa_detail::NextPowerOfTwo(sizeof(Segment));
 
 public:
-	T* New()
+	static constexpr size_t SegmentElements = SegmentSize;
+	// Size of the aligned block each segment takes.
+	static constexpr size_t SegmentBlock = SegmentAlign;
+
+private:
+
+	std::vector<Segment*> segments;
+	size_t maxSegments;
+	// All segments before freeSegment are full.
+	size_t freeSegment = 0;
+
+	// Appends a new segment. Returns nullptr if the size limit is reached.
+	Segment* AddSegment()
+	{
+		if (segments.size() >= maxSegments)
+			return nullptr;
+		void *p;
+		if (posix_memalign(&p, SegmentAlign, sizeof(Segment)))
+			throw std::bad_alloc();
+		Segment *seg = new (p) Segment;
+		seg->index = segments.size();
+		seg->fill = 0;
+		for (size_t i = 0; i < maskN; i++)
+			seg->mask[i] = 0;
+		segments.push_back(seg);
+		return seg;
+	}
+
+	static Segment* SegmentOf(const T *el)
 	{
+		return reinterpret_cast<Segment*>(reinterpret_cast<uintptr_t>(el) & ~(SegmentAlign - 1));
+	}
+
+	// Returns the bits of mask word i which belong to elements.
+	static uint64_t ValidBits(size_t i)
+	{
+		return i == maskN - 1 && SegmentSize % 64 ? ((uint64_t) 1 << SegmentSize % 64) - 1 : ~(uint64_t) 0;
+	}
+
+	// Releases empty segments at the end, keeping up to spare of them.
+	void ReleaseSegments(size_t spare)
+	{
+		size_t end = segments.size();
+		while (end && !segments[end - 1]->fill)
+			end--;
+		while (segments.size() > end + spare)
+		{
+			segments.back()->~Segment();
+			free(segments.back());
+			segments.pop_back();
+		}
+		if (freeSegment > segments.size())
+			freeSegment = segments.size();
+	}
+
+	// Parallel passes have one task per segment.
+	size_t ParallelTasks() const { return segments.size(); }
+
+	template<typename Fn>
+	void ForEachInTask(size_t s, Fn fn)
+	{
+		Segment *seg = segments[s];
+		if (!seg->fill) return;
 		for (size_t i = 0; i < maskN; i++)
+			for (uint64_t m = seg->mask[i]; m; m &= m - 1)
+				fn(seg->data[i*64 + __builtin_ctzll(m)]);
+	}
+
+public:
+	// maxSegments limits the size of the array to maxSegments * SegmentSize elements.
+	explicit GrowableBitmapSA(size_t maxSegments = SIZE_MAX) : maxSegments(maxSegments) { }
+
+	~GrowableBitmapSA()
+	{
+		if (!std::is_trivially_destructible<T>::value)
+			for (T& el : *this)
+				el.~T();
+		for (Segment *seg : segments)
+			seg->fill = 0;
+		ReleaseSegments(0);
+	}
+
+	GrowableBitmapSA(const GrowableBitmapSA&) = delete;
+	GrowableBitmapSA& operator=(const GrowableBitmapSA&) = delete;
+
+	// Releases all empty segments at the end.
+	void Trim()
+	{
+		ReleaseSegments(0);
+	}
+
+	T* New()
+	{
+		return Emplace();
+	}
+
+	// Constructs a new element with the given arguments in an unused spot. Returns nullptr if the
+	// size limit is reached.
+	template<typename... Args>
+	T* Emplace(Args&&... args)
+	{
+		Segment *seg = nullptr;
+		for (; freeSegment < segments.size(); freeSegment++)
+			if (segments[freeSegment]->fill < SegmentSize)
+			{
+				seg = segments[freeSegment];
+				break;
+			}
+		if (!seg && !(seg = AddSegment()))
+			return nullptr;
+		size_t i = sa_detail::FindWordNotEqual(seg->mask, 0, maskN, ~(uint64_t) 0);
+		size_t j = __builtin_ctzll(~seg->mask[i]);
+		seg->mask[i] |= (uint64_t) 1 << j;
+		seg->fill++;
+		return sa_detail::Construct<T>(&seg->data[i*64 + j], std::forward<Args>(args)...);
+	}
+
+	// Claims up to n unused elements in memory order and stores pointers to them in out. Returns the
+	// number of claimed elements.
+	size_t New(size_t n, T **out)
+	{
+		size_t count = 0;
+		for (; count < n; freeSegment++)
 		{
-			uint64_t m = ~mask[i];
-			if (m)
+			if (freeSegment == segments.size() && !AddSegment())
+				break;
+			Segment *seg = segments[freeSegment];
+			for (size_t i = 0; i < maskN && seg->fill < SegmentSize && count < n; i++)
 			{
-				size_t j = __builtin_ffsll(m) - 1;
-				size_t idx = i*64 + j;
-				if (idx >= N) return nullptr;
-				mask[i] |= (uint64_t) 1 << j;
-				return &data[idx];
+				uint64_t m = ~seg->mask[i] & ValidBits(i);
+				// Claim the whole word at once unless we need fewer elements.
+				size_t want = n - count;
+				if ((size_t) __builtin_popcountll(m) > want)
+				{
+					uint64_t rest = m;
+					for (size_t k = 0; k < want; k++)
+						rest &= rest - 1;
+					m &= ~rest;
+				}
+				seg->mask[i] |= m;
+				seg->fill += __builtin_popcountll(m);
+				for (; m; m &= m - 1)
+					out[count++] = sa_detail::Construct<T>(&seg->data[i*64 + __builtin_ctzll(m)]);
 			}
+			if (seg->fill < SegmentSize)
+				break;
 		}
-		return nullptr;
+		return count;
 	}
 
 	void Delete(T *el)
 	{
-		size_t idx = el - data;
-		assert(idx < N);
+		Segment *seg = SegmentOf(el);
+		assert(seg->index < segments.size() && segments[seg->index] == seg);
+		size_t idx = el - seg->data;
 		size_t i = idx / 64, j = idx % 64;
-		mask[i] &= ~((uint64_t) 1 << j);
+		assert(seg->mask[i] >> j & 1);
+		el->~T();
+		seg->mask[i] &= ~((uint64_t) 1 << j);
+		if (seg->index < freeSegment)
+			freeSegment = seg->index;
+		// Keep one empty segment so that we don't reallocate when oscillating around a segment
+		// boundary.
+		if (--seg->fill == 0)
+			ReleaseSegments(1);
 	}
 
-	template<typename Ti, typename SA = BitmapSA>
+	// Calls pred for all used elements in memory order and deletes the elements for which it returns
+	// true. pred must not add or delete elements itself.
+	template<typename Pred>
+	void RemoveIf(Pred pred)
+	{
+		for (Segment *seg : segments)
+		{
+			if (!seg->fill) continue;
+			for (size_t i = 0; i < maskN; i++)
+			{
+				uint64_t removed = 0;
+				for (uint64_t m = seg->mask[i]; m; m &= m - 1)
+				{
+					size_t j = __builtin_ctzll(m);
+					if (pred(seg->data[i*64 + j]))
+					{
+						seg->data[i*64 + j].~T();
+						removed |= (uint64_t) 1 << j;
+					}
+				}
+				seg->mask[i] &= ~removed;
+				seg->fill -= __builtin_popcountll(removed);
+				if (removed && seg->index < freeSegment)
+					freeSegment = seg->index;
+			}
+		}
+		ReleaseSegments(1);
+	}
+
+	// Calls fn for all used elements on the threads of pool and deletes the elements for which it
+	// returns true afterwards. fn is called concurrently for different elements and must not add or
+	// delete elements itself.
+	template<typename Fn>
+	void ParallelForEach(Fn fn, ThreadPool& pool)
+	{
+		sa_detail::ParallelPass<T>(pool, ParallelTasks(), [&](size_t task, std::vector<T*>& deleted)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el)) deleted.push_back(&el); });
+		}, [this](T *el) { Delete(el); });
+	}
+
+	// Like ParallelForEach, but the outcome doesn't depend on the number of threads. fn(el, task) may
+	// update task.value and Spawn new elements. Returns the values of all tasks combined in order.
+	template<typename Acc, typename Fn, typename Combine = std::plus<Acc>>
+	Acc DeterministicForEach(Fn fn, ThreadPool& pool, Combine combine = Combine())
+	{
+		return sa_detail::DeterministicPass<T, Acc>(pool, ParallelTasks(), [&](size_t task, DeterministicTask<T, Acc>& state)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el, state)) state.deleted.push_back(&el); });
+		}, combine, [this](T *el) { Delete(el); }, [this](const T& el) { Emplace(el); });
+	}
+
+	template<typename Ti, typename SA = GrowableBitmapSA>
 	class Iterator : public std::iterator<std::forward_iterator_tag, Ti>
 	{
 		SA *array;
-		size_t el, pos, start; // el: current element in data, pos: current bit position in cur
-		uint64_t cur;
+		Segment *seg; // current segment
+		size_t s, el; // index of seg, element in seg
+		uint64_t cur; // remaining used bits in the mask word of el
+
+		// Moves to the first used element in segment s, starting with mask word i whose remaining bits
+		// are m.
+		Iterator& next(size_t i, uint64_t m)
+		{
+			while (!m)
+			{
+				// Skip empty mask words and segments. Delete may have released the current segment.
+				const auto& segments = array->segments;
+				if (s < segments.size() && segments[s]->fill)
+					i = sa_detail::FindWordNotEqual(segments[s]->mask, i + 1, maskN, 0);
+				else
+					i = maskN;
+				if (i >= maskN)
+				{
+					if (++s >= segments.size())
+					{
+						array = nullptr;
+						seg = nullptr;
+						s = el = 0;
+						cur = 0;
+						return *this;
+					}
+					i = 0;
+				}
+				seg = segments[s];
+				m = seg->mask[i];
+			}
+			el = i*64 + __builtin_ctzll(m);
+			cur = m & (m - 1);
+			return *this;
+		}
+
 	public:
-		Iterator(SA *array) : array(array), el(0), pos(64), cur(0)
+		Iterator(SA *array) : array(array), seg(nullptr), s(0), el(0), cur(0)
 		{
-			start = 1;
 			if (array)
-				operator++();
-			start = 0;
+			{
+				if (array->segments.empty())
+					this->array = nullptr;
+				else
+				{
+					seg = array->segments[0];
+					next(0, seg->mask[0]);
+				}
+			}
 		}
 
 		Iterator& operator++()
 		{
 			assert(array);
-			while (!cur)
-			{
-				el += 64 - pos;
-				if (el >= N) break;
-				pos = 0;
-				cur = array->mask[(el + 1) / 64];
-			}
-			size_t inc = __builtin_ffsll(cur);
-			el += inc - start;
-			pos += inc;
-			cur >>= inc;
-			if (el >= N)
-			{
-				array = nullptr;
-				el = 0;
-			}
-			return *this;
+			return next(el / 64, cur);
 		}
 
-		bool operator==(Iterator other) { return array == other.array && el == other.el; }
+		bool operator==(Iterator other) { return array == other.array && s == other.s && el == other.el; }
 		bool operator!=(Iterator other) { return !(*this == other); }
-		Ti& operator*() const { assert(el < N); return array->data[el]; }
+		Ti& operator*() const { return seg->data[el]; }
 	};
 
 	Iterator<T> begin() { return Iterator<T>(this); }
 	Iterator<T> end() { return Iterator<T>(nullptr); }
-	Iterator<const T, const BitmapSA> begin() const { return Iterator<const T, const BitmapSA>(this); }
-	Iterator<const T, const BitmapSA> end() const { return Iterator<const T, const BitmapSA>(nullptr); }
+	Iterator<const T, const GrowableBitmapSA> begin() const { return Iterator<const T, const GrowableBitmapSA>(this); }
+	Iterator<const T, const GrowableBitmapSA> end() const { return Iterator<const T, const GrowableBitmapSA>(nullptr); }
 };
 
-template<typename T, size_t N, size_t ChunkSize = 500>
+template<typename T, size_t SegmentSize>
+constexpr size_t GrowableBitmapSA<T, SegmentSize>::SegmentElements;
+template<typename T, size_t SegmentSize>
+constexpr size_t GrowableBitmapSA<T, SegmentSize>::SegmentBlock;
+
+// Empty chunks are kept in a pool for reuse. When the pool grows beyond PoolHigh chunks, it is
+// shrunk to PoolLow chunks. The default ChunkSize fills the chunks' aligned blocks, see ChunkHeader.
+template<typename T, size_t N, size_t ChunkSize = sa_detail::FillingChunkSize(N, sizeof(size_t), sizeof(T), alignof(T)), size_t PoolHigh = 4, size_t PoolLow = 1>
 class ChunkSA
 {
 	static_assert(N % ChunkSize == 0, "N must be a multiple of ChunkSize");
+	static_assert(PoolLow <= PoolHigh, "PoolLow must not be larger than PoolHigh");
 	static constexpr size_t MaxChunk = N / ChunkSize;
+	static constexpr size_t ChunkWords = (ChunkSize + 63) / 64;
 	T *Chunk[MaxChunk];
 	size_t ChunkFill[MaxChunk];
-	std::bitset<N> UsedElements;
+	// Chunks with at least one unused or used element, respectively.
+	sa_detail::Bitmap<MaxChunk> NonFullChunks, NonEmptyChunks;
+	// All chunks before freeChunk are full.
+	size_t freeChunk = 0;
+	// CompactStep continues its search for elements to move here, counted from the first element.
+	// There are no used elements between the first unused spot and compactFrom.
+	size_t compactFrom = 0;
+	// Retired chunks. Their occupancy words are all zero.
+	T *Pool[PoolHigh + 1];
+	size_t poolSize = 0;
+
+	// Chunks start with a header and are aligned to their size rounded up to a power of two. Delete
+	// finds an element's chunk by masking its address. The allocator can't use the rest of the
+	// aligned block, so a chunk costs its full alignment.
+	struct ChunkHeader
+	{
+		size_t index;
+		// One bit per element, set if the element is in use.
+		uint64_t used[ChunkWords];
+	};
+	static constexpr size_t DataOffset = (sizeof(ChunkHeader) + alignof(T) - 1) / alignof(T) * alignof(T);
+	static constexpr size_t ChunkBytes = DataOffset + sizeof(T) * ChunkSize;
+	static constexpr size_t ChunkAlign = sa_detail::NextPowerOfTwo(ChunkBytes);
+
+	// Chunks are raw memory, elements are only constructed when they are in use.
+	T* AllocateChunk(size_t i)
+	{
+		T *chunk;
+		if (poolSize)
+			chunk = Pool[--poolSize];
+		else
+		{
+			void *p;
+			if (posix_memalign(&p, ChunkAlign, ChunkBytes))
+				throw std::bad_alloc();
+			ChunkHeader *header = static_cast<ChunkHeader*>(p);
+			for (size_t w = 0; w < ChunkWords; w++)
+				header->used[w] = 0;
+			chunk = reinterpret_cast<T*>(static_cast<char*>(p) + DataOffset);
+		}
+		HeaderOf(chunk)->index = i;
+		return chunk;
+	}
+
+	// Moves the empty chunk i to the pool.
+	void RetireChunk(size_t i)
+	{
+		Pool[poolSize++] = Chunk[i];
+		Chunk[i] = nullptr;
+		if (poolSize > PoolHigh)
+			while (poolSize > PoolLow)
+				FreeChunk(Pool[--poolSize]);
+	}
+
+	static void FreeChunk(T *chunk)
+	{
+		free(reinterpret_cast<char*>(chunk) - DataOffset);
+	}
+
+	static ChunkHeader* HeaderOf(const T *el)
+	{
+		return reinterpret_cast<ChunkHeader*>(reinterpret_cast<uintptr_t>(el) & ~(ChunkAlign - 1));
+	}
+
+	// Returns the occupancy words of the allocated chunk i.
+	uint64_t* UsedWords(size_t i) const
+	{
+		return reinterpret_cast<ChunkHeader*>(reinterpret_cast<char*>(Chunk[i]) - DataOffset)->used;
+	}
+
+	// Returns the bits of occupancy word w which belong to elements.
+	static uint64_t ValidBits(size_t w)
+	{
+		return w == ChunkWords - 1 && ChunkSize % 64 ? ((uint64_t) 1 << ChunkSize % 64) - 1 : ~(uint64_t) 0;
+	}
+
+	// Returns the position of the first used element at or after k, counted from the first element,
+	// or N if there is none.
+	size_t FindUsed(size_t k) const
+	{
+		size_t i = k / ChunkSize, j = k % ChunkSize;
+		if (k < N && ChunkFill[i])
+		{
+			const uint64_t *used = UsedWords(i);
+			for (size_t w = j / 64; w < ChunkWords; w++)
+				if (uint64_t m = used[w] & (w == j / 64 ? ~(uint64_t) 0 << j % 64 : ~(uint64_t) 0))
+					return i*ChunkSize + w*64 + __builtin_ctzll(m);
+		}
+		i = NonEmptyChunks.FindNextSet(i + 1);
+		if (i == NonEmptyChunks.npos) return N;
+		const uint64_t *used = UsedWords(i);
+		for (size_t w = 0; ; w++)
+			if (used[w])
+				return i*ChunkSize + w*64 + __builtin_ctzll(used[w]);
+	}
+
+	// Parallel passes have one task per chunk.
+	size_t ParallelTasks() const { return MaxChunk; }
+
+	template<typename Fn>
+	void ForEachInTask(size_t i, Fn fn)
+	{
+		if (!ChunkFill[i]) return;
+		uint64_t *used = UsedWords(i);
+		for (size_t w = 0; w < ChunkWords; w++)
+			for (uint64_t m = used[w]; m; m &= m - 1)
+				fn(Chunk[i][w*64 + __builtin_ctzll(m)]);
+	}
 
 public:
+	static constexpr size_t ChunkElements = ChunkSize;
 
 	ChunkSA()
 	{
@@ -100,60 +1900,285 @@ public:
 		{
 			Chunk[i] = nullptr;
 			ChunkFill[i] = 0;
+			NonFullChunks.set(i);
 		}
 	}
 
 	~ChunkSA()
 	{
+		if (!std::is_trivially_destructible<T>::value)
+			for (T& el : *this)
+				el.~T();
 		for (size_t i = 0; i < MaxChunk; i++)
 		{
-			if (Chunk[i]) delete[] Chunk[i];
+			if (Chunk[i]) FreeChunk(Chunk[i]);
 			Chunk[i] = nullptr;
 			ChunkFill[i] = 0;
 		}
+		Trim();
+	}
+
+	// Releases all retired chunks.
+	void Trim()
+	{
+		while (poolSize)
+			FreeChunk(Pool[--poolSize]);
 	}
 
 	T* New()
 	{
-		for (size_t i = 0; i < MaxChunk; i++)
+		return Emplace();
+	}
+
+	// Constructs a new element with the given arguments in an unused spot. Returns nullptr if the
+	// array is full.
+	template<typename... Args>
+	T* Emplace(Args&&... args)
+	{
+		size_t i = freeChunk = NonFullChunks.FindNextSet(freeChunk);
+		if (i == NonFullChunks.npos)
 		{
+			freeChunk = MaxChunk;
+			return nullptr;
+		}
+		// Create new chunk if necessary.
+		if (!Chunk[i])
+		{
+			Chunk[i] = AllocateChunk(i);
+			ChunkFill[i] = 0;
+		}
+		uint64_t *used = UsedWords(i);
+		for (size_t w = 0; ; w++)
+			if (uint64_t m = ~used[w] & ValidBits(w))
+			{
+				size_t b = __builtin_ctzll(m);
+				used[w] |= (uint64_t) 1 << b;
+				if (ChunkFill[i]++ == 0)
+					NonEmptyChunks.set(i);
+				if (ChunkFill[i] == ChunkSize)
+					NonFullChunks.reset(i);
+				return sa_detail::Construct<T>(&Chunk[i][w*64 + b], std::forward<Args>(args)...);
+			}
+	}
+
+	// Claims up to n unused elements in memory order and stores pointers to them in out. Returns the
+	// number of claimed elements.
+	size_t New(size_t n, T **out)
+	{
+		size_t count = 0;
+		for (size_t i = NonFullChunks.FindNextSet(freeChunk); i != NonFullChunks.npos && count < n; i = NonFullChunks.FindNextSet(i + 1))
+		{
+			// All chunks before are full now.
+			freeChunk = i;
 			// Create new chunk if necessary.
 			if (!Chunk[i])
 			{
-				Chunk[i] = new T[ChunkSize];
+				Chunk[i] = AllocateChunk(i);
 				ChunkFill[i] = 0;
 			}
-			// Check this chunk for space.
-			if (ChunkFill[i] < ChunkSize)
-				for (size_t j = 0; j < ChunkSize; j++)
-					if (!UsedElements[i*ChunkSize + j])
+			// Take as many elements from this chunk as possible.
+			uint64_t *used = UsedWords(i);
+			for (size_t w = 0; w < ChunkWords && ChunkFill[i] < ChunkSize && count < n; w++)
+			{
+				uint64_t m = ~used[w] & ValidBits(w);
+				size_t want = n - count;
+				if ((size_t) __builtin_popcountll(m) > want)
+				{
+					uint64_t rest = m;
+					for (size_t k = 0; k < want; k++)
+						rest &= rest - 1;
+					m &= ~rest;
+				}
+				used[w] |= m;
+				ChunkFill[i] += __builtin_popcountll(m);
+				for (; m; m &= m - 1)
+					out[count++] = sa_detail::Construct<T>(&Chunk[i][w*64 + __builtin_ctzll(m)]);
+			}
+			if (ChunkFill[i])
+				NonEmptyChunks.set(i);
+			if (ChunkFill[i] == ChunkSize)
+				NonFullChunks.reset(i);
+		}
+		if (count < n)
+			freeChunk = MaxChunk;
+		return count;
+	}
+
+	void Delete(T *el)
+	{
+		ChunkHeader *header = HeaderOf(el);
+		size_t i = header->index;
+		assert(NonEmptyChunks[i] && el >= &Chunk[i][0] && el < &Chunk[i][ChunkSize]);
+
+		size_t j = el - &Chunk[i][0];
+		assert(header->used[j / 64] >> j % 64 & 1);
+		el->~T();
+		header->used[j / 64] &= ~((uint64_t) 1 << j % 64);
+		if (i < freeChunk)
+			freeChunk = i;
+		if (i*ChunkSize + j < compactFrom)
+			compactFrom = i*ChunkSize + j;
+
+		NonFullChunks.set(i);
+		if (--ChunkFill[i] == 0)
+		{
+			NonEmptyChunks.reset(i);
+			RetireChunk(i);
+		}
+	}
+
+	// Calls pred for all used elements in memory order and deletes the elements for which it returns
+	// true. pred must not add or delete elements itself.
+	template<typename Pred>
+	void RemoveIf(Pred pred)
+	{
+		for (size_t i = NonEmptyChunks.FindNextSet(0); i != NonEmptyChunks.npos; i = NonEmptyChunks.FindNextSet(i + 1))
+		{
+			uint64_t *used = UsedWords(i);
+			for (size_t w = 0; w < ChunkWords; w++)
+			{
+				uint64_t removed = 0;
+				for (uint64_t m = used[w]; m; m &= m - 1)
+				{
+					size_t j = w*64 + __builtin_ctzll(m);
+					if (pred(Chunk[i][j]))
 					{
-						UsedElements.set(i*ChunkSize + j);
-						ChunkFill[i]++;
-						return &Chunk[i][j];
+						Chunk[i][j].~T();
+						removed |= m & -m;
 					}
+				}
+				used[w] &= ~removed;
+				ChunkFill[i] -= __builtin_popcountll(removed);
+				if (removed)
+				{
+					NonFullChunks.set(i);
+					if (i < freeChunk)
+						freeChunk = i;
+					if (i*ChunkSize + w*64 < compactFrom)
+						compactFrom = i*ChunkSize + w*64;
+				}
+			}
+			if (!ChunkFill[i])
+			{
+				NonEmptyChunks.reset(i);
+				RetireChunk(i);
+			}
 		}
-		return nullptr;
 	}
 
-	void Delete(T *el)
+	// Returns the share of unused spots before the last used element, from 0 to 1. Iteration has to
+	// skip these, so Compact pays off when this is high.
+	double Fragmentation() const
+	{
+		size_t used = 0, span = 0;
+		for (size_t i = NonEmptyChunks.FindNextSet(0); i != NonEmptyChunks.npos; i = NonEmptyChunks.FindNextSet(i + 1))
+		{
+			const uint64_t *words = UsedWords(i);
+			used += ChunkFill[i];
+			size_t w = ChunkWords - 1;
+			while (!words[w])
+				w--;
+			span = i*ChunkSize + w*64 + 64 - __builtin_clzll(words[w]);
+		}
+		return used ? 1 - (double) used / span : 0;
+	}
+
+	// Moves the used elements into the lowest unused spots, keeping their order, and calls
+	// relocate(from, to) for each move. Chunks which become empty are retired. Returns the number of
+	// moved elements. Pointers to moved elements become invalid, so this must not be called during
+	// iteration.
+	template<typename Relocate = NoRelocation>
+	size_t Compact(Relocate relocate = Relocate())
+	{
+		return CompactStep<Relocate&>(N, relocate);
+	}
+
+	// Like Compact, but moves at most maxMoves elements and continues where the last call stopped.
+	// The array stays consistent between calls, so this can run once per frame. New, Delete and
+	// RemoveIf may be called in between; deletions before the current position restart the search.
+	// Returns the number of moved elements. Fewer than maxMoves means that the array is compact.
+	template<typename Relocate = NoRelocation>
+	size_t CompactStep(size_t maxMoves, Relocate relocate = Relocate())
+	{
+		size_t moved = 0;
+		for (; moved < maxMoves; moved++)
+		{
+			size_t i = freeChunk = NonFullChunks.FindNextSet(freeChunk);
+			if (i == NonFullChunks.npos)
+			{
+				freeChunk = MaxChunk;
+				break;
+			}
+			size_t j = 0;
+			if (ChunkFill[i])
+			{
+				uint64_t *used = UsedWords(i);
+				size_t w = 0;
+				while (!(~used[w] & ValidBits(w)))
+					w++;
+				j = w*64 + __builtin_ctzll(~used[w]);
+			}
+
+			// Move the first used element after the unused spot j of chunk i.
+			size_t from = FindUsed(std::max(i*ChunkSize + j + 1, compactFrom));
+			if (from == N) break;
+			size_t fi = from / ChunkSize, fj = from % ChunkSize;
+			// The first chunk with space may have been retired.
+			if (!Chunk[i])
+				Chunk[i] = AllocateChunk(i);
+			sa_detail::MoveElement(&Chunk[fi][fj], &Chunk[i][j], relocate);
+			UsedWords(i)[j / 64] |= (uint64_t) 1 << j % 64;
+			if (ChunkFill[i]++ == 0)
+				NonEmptyChunks.set(i);
+			if (ChunkFill[i] == ChunkSize)
+				NonFullChunks.reset(i);
+			UsedWords(fi)[fj / 64] &= ~((uint64_t) 1 << fj % 64);
+			NonFullChunks.set(fi);
+			if (--ChunkFill[fi] == 0)
+			{
+				NonEmptyChunks.reset(fi);
+				RetireChunk(fi);
+			}
+			compactFrom = from + 1;
+		}
+		return moved;
+	}
+
+	// Runs CompactStep until the array is compact or the time budget is used up. Returns the number
+	// of moved elements.
+	template<typename Relocate = NoRelocation>
+	size_t CompactFor(std::chrono::microseconds budget, Relocate relocate = Relocate())
+	{
+		auto deadline = std::chrono::steady_clock::now() + budget;
+		size_t moved = 0, step;
+		// Reading the clock costs more than a move, so check it only every 64 moves.
+		do
+			moved += step = CompactStep<Relocate&>(64, relocate);
+		while (step == 64 && std::chrono::steady_clock::now() < deadline);
+		return moved;
+	}
+
+	// Calls fn for all used elements on the threads of pool and deletes the elements for which it
+	// returns true afterwards. fn is called concurrently for different elements and must not add or
+	// delete elements itself.
+	template<typename Fn>
+	void ParallelForEach(Fn fn, ThreadPool& pool)
+	{
+		sa_detail::ParallelPass<T>(pool, ParallelTasks(), [&](size_t task, std::vector<T*>& deleted)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el)) deleted.push_back(&el); });
+		}, [this](T *el) { Delete(el); });
+	}
+
+	// Like ParallelForEach, but the outcome doesn't depend on the number of threads. fn(el, task) may
+	// update task.value and Spawn new elements. Returns the values of all tasks combined in order.
+	template<typename Acc, typename Fn, typename Combine = std::plus<Acc>>
+	Acc DeterministicForEach(Fn fn, ThreadPool& pool, Combine combine = Combine())
 	{
-		size_t i, j;
-		for (i = 0; i < MaxChunk; i++)
-			if (ChunkFill[i])
-				if (el >= &Chunk[i][0] && el < &Chunk[i][ChunkSize])
-					break;
-		assert(i < MaxChunk);
-
-		j = el - &Chunk[i][0];
-		assert(UsedElements[i*ChunkSize + j]);
-		UsedElements.reset(i*ChunkSize + j);
-
-		if (--ChunkFill[i] == 0)
+		return sa_detail::DeterministicPass<T, Acc>(pool, ParallelTasks(), [&](size_t task, DeterministicTask<T, Acc>& state)
 		{
-			delete[] Chunk[i];
-			Chunk[i] = nullptr;
-		}
+			ForEachInTask(task, [&](T& el) { if (fn(el, state)) state.deleted.push_back(&el); });
+		}, combine, [this](T *el) { Delete(el); }, [this](const T& el) { Emplace(el); });
 	}
 
 	template<typename Ti, typename SA = ChunkSA>
@@ -161,37 +2186,50 @@ public:
 	{
 		SA *array;
 		size_t i, j; // chunk, position in chunk
+		uint64_t cur; // remaining used bits in the occupancy word of j
 
-		Iterator& next(bool return_next)
+		// Moves to the first used element in chunk c, starting with occupancy word w whose remaining
+		// bits are m.
+		Iterator& next(size_t c, size_t w, uint64_t m)
 		{
-			for (; i < MaxChunk; i++, j = 0)
+			while (!m)
 			{
-				if (array->ChunkFill[i])
+				if (++w == ChunkWords || !array->ChunkFill[c])
 				{
-					for (; j < ChunkSize; j++)
+					// Skip empty chunks.
+					c = array->NonEmptyChunks.FindNextSet(c + 1);
+					if (c == array->NonEmptyChunks.npos)
 					{
-						if (array->UsedElements[i*ChunkSize + j] && return_next)
-							return *this;
-						return_next = true;
+						// We're at the end.
+						array = nullptr;
+						i = j = 0;
+						cur = 0;
+						return *this;
 					}
+					w = 0;
 				}
-				return_next = true;
+				m = array->UsedWords(c)[w];
 			}
-			// We're at the end.
-			array = nullptr;
-			i = j = 0;
+			i = c;
+			j = w*64 + __builtin_ctzll(m);
+			cur = m & (m - 1);
 			return *this;
 		}
 	public:
-		Iterator(SA *array) : array(array), i(0), j(0)
+		Iterator(SA *array) : array(array), i(0), j(0), cur(0)
 		{
 			if (array)
-				next(true);
+			{
+				if (array->ChunkFill[0])
+					next(0, 0, array->UsedWords(0)[0]);
+				else
+					next(0, ChunkWords - 1, 0);
+			}
 		}
 
 		Iterator& operator++()
 		{
-			return next(false);
+			return next(i, j / 64, cur);
 		}
 
 		bool operator==(Iterator other) { return array == other.array && i == other.i && j == other.j; }
@@ -205,14 +2243,65 @@ public:
 	Iterator<const T, const ChunkSA> end() const { return Iterator<const T, const ChunkSA>(nullptr); }
 };
 
+template<typename T, size_t N, size_t ChunkSize, size_t PoolHigh, size_t PoolLow>
+constexpr size_t ChunkSA<T, N, ChunkSize, PoolHigh, PoolLow>::ChunkElements;
+
 template<typename T, size_t N, size_t ChunkSize = 500>
 class StaticChunkSA
 {
 	static_assert(N % ChunkSize == 0, "N must be a multiple of ChunkSize");
 	static constexpr size_t MaxChunk = N / ChunkSize;
-	T Chunk[MaxChunk][ChunkSize];
+	static constexpr size_t ChunkWords = (ChunkSize + 63) / 64;
+	// Elements are only constructed when they are in use.
+	union { T Chunk[MaxChunk][ChunkSize]; };
 	size_t ChunkFill[MaxChunk];
-	std::bitset<N> UsedElements;
+	// Chunks with at least one unused or used element, respectively.
+	sa_detail::Bitmap<MaxChunk> NonFullChunks, NonEmptyChunks;
+	// One bit per element, set if the element is in use.
+	uint64_t Used[MaxChunk][ChunkWords] = {};
+	// All chunks before freeChunk are full.
+	size_t freeChunk = 0;
+	// CompactStep continues its search for elements to move here, counted from the first element.
+	// There are no used elements between the first unused spot and compactFrom.
+	size_t compactFrom = 0;
+
+	// Returns the bits of occupancy word w which belong to elements.
+	static uint64_t ValidBits(size_t w)
+	{
+		return w == ChunkWords - 1 && ChunkSize % 64 ? ((uint64_t) 1 << ChunkSize % 64) - 1 : ~(uint64_t) 0;
+	}
+
+	// Returns the position of the first used element at or after k, counted from the first element,
+	// or N if there is none.
+	size_t FindUsed(size_t k) const
+	{
+		size_t i = k / ChunkSize, j = k % ChunkSize;
+		if (k < N && ChunkFill[i])
+		{
+			const uint64_t *used = Used[i];
+			for (size_t w = j / 64; w < ChunkWords; w++)
+				if (uint64_t m = used[w] & (w == j / 64 ? ~(uint64_t) 0 << j % 64 : ~(uint64_t) 0))
+					return i*ChunkSize + w*64 + __builtin_ctzll(m);
+		}
+		i = NonEmptyChunks.FindNextSet(i + 1);
+		if (i == NonEmptyChunks.npos) return N;
+		const uint64_t *used = Used[i];
+		for (size_t w = 0; ; w++)
+			if (used[w])
+				return i*ChunkSize + w*64 + __builtin_ctzll(used[w]);
+	}
+
+	// Parallel passes have one task per chunk.
+	size_t ParallelTasks() const { return MaxChunk; }
+
+	template<typename Fn>
+	void ForEachInTask(size_t i, Fn fn)
+	{
+		if (!ChunkFill[i]) return;
+		for (size_t w = 0; w < ChunkWords; w++)
+			for (uint64_t m = Used[i][w]; m; m &= m - 1)
+				fn(Chunk[i][w*64 + __builtin_ctzll(m)]);
+	}
 
 public:
 
@@ -221,40 +2310,277 @@ public:
 		for (size_t i = 0; i < MaxChunk; i++)
 		{
 			ChunkFill[i] = 0;
+			NonFullChunks.set(i);
 		}
 	}
 
+	~StaticChunkSA()
+	{
+		if (!std::is_trivially_destructible<T>::value)
+			for (T& el : *this)
+				el.~T();
+	}
+
 	T* New()
 	{
-		for (size_t i = 0; i < MaxChunk; i++)
+		return Emplace();
+	}
+
+	// Constructs a new element with the given arguments in an unused spot. Returns nullptr if the
+	// array is full.
+	template<typename... Args>
+	T* Emplace(Args&&... args)
+	{
+		size_t i = freeChunk = NonFullChunks.FindNextSet(freeChunk);
+		if (i == NonFullChunks.npos)
+		{
+			freeChunk = MaxChunk;
+			return nullptr;
+		}
+		uint64_t *used = Used[i];
+		for (size_t w = 0; ; w++)
+			if (uint64_t m = ~used[w] & ValidBits(w))
+			{
+				size_t b = __builtin_ctzll(m);
+				used[w] |= (uint64_t) 1 << b;
+				if (ChunkFill[i]++ == 0)
+					NonEmptyChunks.set(i);
+				if (ChunkFill[i] == ChunkSize)
+					NonFullChunks.reset(i);
+				return sa_detail::Construct<T>(&Chunk[i][w*64 + b], std::forward<Args>(args)...);
+			}
+	}
+
+	// Claims up to n unused elements in memory order and stores pointers to them in out. Returns the
+	// number of claimed elements.
+	size_t New(size_t n, T **out)
+	{
+		size_t count = 0;
+		for (size_t i = NonFullChunks.FindNextSet(freeChunk); i != NonFullChunks.npos && count < n; i = NonFullChunks.FindNextSet(i + 1))
+		{
+			// All chunks before are full now.
+			freeChunk = i;
+			// Take as many elements from this chunk as possible.
+			uint64_t *used = Used[i];
+			for (size_t w = 0; w < ChunkWords && ChunkFill[i] < ChunkSize && count < n; w++)
+			{
+				uint64_t m = ~used[w] & ValidBits(w);
+				size_t want = n - count;
+				if ((size_t) __builtin_popcountll(m) > want)
+				{
+					uint64_t rest = m;
+					for (size_t k = 0; k < want; k++)
+						rest &= rest - 1;
+					m &= ~rest;
+				}
+				used[w] |= m;
+				ChunkFill[i] += __builtin_popcountll(m);
+				for (; m; m &= m - 1)
+					out[count++] = sa_detail::Construct<T>(&Chunk[i][w*64 + __builtin_ctzll(m)]);
+			}
+			if (ChunkFill[i])
+				NonEmptyChunks.set(i);
+			if (ChunkFill[i] == ChunkSize)
+				NonFullChunks.reset(i);
+		}
+		if (count < n)
+			freeChunk = MaxChunk;
+		return count;
+	}
+
+	void Delete(T *el)
+	{
+		// The chunks are contiguous, so the chunk follows from the byte offset to the first one.
+		// Pointer arithmetic is only valid within a chunk.
+		size_t i = (reinterpret_cast<uintptr_t>(el) - reinterpret_cast<uintptr_t>(Chunk)) / sizeof(Chunk[0]);
+		assert(i < MaxChunk);
+		size_t j = el - &Chunk[i][0], idx = i*ChunkSize + j;
+		assert(Used[i][j / 64] >> j % 64 & 1);
+		el->~T();
+		Used[i][j / 64] &= ~((uint64_t) 1 << j % 64);
+		if (i < freeChunk)
+			freeChunk = i;
+		if (idx < compactFrom)
+			compactFrom = idx;
+
+		NonFullChunks.set(i);
+		if (--ChunkFill[i] == 0)
+			NonEmptyChunks.reset(i);
+	}
+
+	// Calls pred for all used elements in memory order and deletes the elements for which it returns
+	// true. pred must not add or delete elements itself.
+	template<typename Pred>
+	void RemoveIf(Pred pred)
+	{
+		for (size_t i = NonEmptyChunks.FindNextSet(0); i != NonEmptyChunks.npos; i = NonEmptyChunks.FindNextSet(i + 1))
 		{
-			// Check this chunk for space.
-			if (ChunkFill[i] < ChunkSize)
-				for (size_t j = 0; j < ChunkSize; j++)
-					if (!UsedElements[i*ChunkSize + j])
+			uint64_t *used = Used[i];
+			for (size_t w = 0; w < ChunkWords; w++)
+			{
+				uint64_t removed = 0;
+				for (uint64_t m = used[w]; m; m &= m - 1)
+				{
+					size_t j = w*64 + __builtin_ctzll(m);
+					if (pred(Chunk[i][j]))
 					{
-						UsedElements.set(i*ChunkSize + j);
-						ChunkFill[i]++;
-						return &Chunk[i][j];
+						Chunk[i][j].~T();
+						removed |= m & -m;
 					}
+				}
+				used[w] &= ~removed;
+				ChunkFill[i] -= __builtin_popcountll(removed);
+				if (removed)
+				{
+					NonFullChunks.set(i);
+					if (i < freeChunk)
+						freeChunk = i;
+					if (i*ChunkSize + w*64 < compactFrom)
+						compactFrom = i*ChunkSize + w*64;
+				}
+			}
+			if (!ChunkFill[i])
+				NonEmptyChunks.reset(i);
 		}
-		return nullptr;
 	}
 
-	void Delete(T *el)
+	// Returns the share of unused spots before the last used element, from 0 to 1. Iteration has to
+	// skip these, so Compact pays off when this is high.
+	double Fragmentation() const
+	{
+		size_t used = 0, span = 0;
+		for (size_t i = NonEmptyChunks.FindNextSet(0); i != NonEmptyChunks.npos; i = NonEmptyChunks.FindNextSet(i + 1))
+		{
+			used += ChunkFill[i];
+			size_t w = ChunkWords - 1;
+			while (!Used[i][w])
+				w--;
+			span = i*ChunkSize + w*64 + 64 - __builtin_clzll(Used[i][w]);
+		}
+		return used ? 1 - (double) used / span : 0;
+	}
+
+	// Moves the used elements into the lowest unused spots, keeping their order, and calls
+	// relocate(from, to) for each move. Returns the number of moved elements. Pointers to moved
+	// elements become invalid, so this must not be called during iteration.
+	template<typename Relocate = NoRelocation>
+	size_t Compact(Relocate relocate = Relocate())
+	{
+		// All chunks before freeChunk are full already.
+		if (freeChunk == MaxChunk) return 0;
+		size_t to = freeChunk * ChunkSize, moved = 0;
+		for (size_t i = NonEmptyChunks.FindNextSet(freeChunk); i != NonEmptyChunks.npos; i = NonEmptyChunks.FindNextSet(i + 1))
+			for (size_t w = 0; w < ChunkWords; w++)
+				for (uint64_t m = Used[i][w]; m; m &= m - 1)
+				{
+					size_t from = i*ChunkSize + w*64 + __builtin_ctzll(m);
+					if (from != to)
+					{
+						sa_detail::MoveElement(&Chunk[i][from - i*ChunkSize], &Chunk[to / ChunkSize][to % ChunkSize], relocate);
+						moved++;
+					}
+					to++;
+				}
+		// Now exactly the first to elements are used.
+		for (size_t i = freeChunk; i < MaxChunk; i++)
+		{
+			size_t fill = to > i*ChunkSize ? std::min(to - i*ChunkSize, ChunkSize) : 0;
+			ChunkFill[i] = fill;
+			for (size_t w = 0; w < ChunkWords; w++)
+				Used[i][w] = fill >= w*64 + 64 ? ~(uint64_t) 0 : fill > w*64 ? ((uint64_t) 1 << (fill - w*64)) - 1 : 0;
+			if (fill)
+				NonEmptyChunks.set(i);
+			else
+				NonEmptyChunks.reset(i);
+			if (fill < ChunkSize)
+				NonFullChunks.set(i);
+			else
+				NonFullChunks.reset(i);
+		}
+		freeChunk = to / ChunkSize;
+		return moved;
+	}
+
+	// Like Compact, but moves at most maxMoves elements and continues where the last call stopped.
+	// The array stays consistent between calls, so this can run once per frame. New, Delete and
+	// RemoveIf may be called in between; deletions before the current position restart the search.
+	// Returns the number of moved elements. Fewer than maxMoves means that the array is compact.
+	template<typename Relocate = NoRelocation>
+	size_t CompactStep(size_t maxMoves, Relocate relocate = Relocate())
 	{
-		size_t i, j;
-		for (i = 0; i < MaxChunk; i++)
+		size_t moved = 0;
+		for (; moved < maxMoves; moved++)
+		{
+			size_t i = freeChunk = NonFullChunks.FindNextSet(freeChunk);
+			if (i == NonFullChunks.npos)
+			{
+				freeChunk = MaxChunk;
+				break;
+			}
+			size_t j = 0;
 			if (ChunkFill[i])
-				if (el >= &Chunk[i][0] && el < &Chunk[i][ChunkSize])
-					break;
-		assert(i < MaxChunk);
+			{
+				uint64_t *used = Used[i];
+				size_t w = 0;
+				while (!(~used[w] & ValidBits(w)))
+					w++;
+				j = w*64 + __builtin_ctzll(~used[w]);
+			}
+
+			// Move the first used element after the unused spot j of chunk i.
+			size_t from = FindUsed(std::max(i*ChunkSize + j + 1, compactFrom));
+			if (from == N) break;
+			size_t fi = from / ChunkSize, fj = from % ChunkSize;
+			sa_detail::MoveElement(&Chunk[fi][fj], &Chunk[i][j], relocate);
+			Used[i][j / 64] |= (uint64_t) 1 << j % 64;
+			if (ChunkFill[i]++ == 0)
+				NonEmptyChunks.set(i);
+			if (ChunkFill[i] == ChunkSize)
+				NonFullChunks.reset(i);
+			Used[fi][fj / 64] &= ~((uint64_t) 1 << fj % 64);
+			NonFullChunks.set(fi);
+			if (--ChunkFill[fi] == 0)
+				NonEmptyChunks.reset(fi);
+			compactFrom = from + 1;
+		}
+		return moved;
+	}
 
-		j = el - &Chunk[i][0];
-		assert(UsedElements[i*ChunkSize + j]);
-		UsedElements.reset(i*ChunkSize + j);
+	// Runs CompactStep until the array is compact or the time budget is used up. Returns the number
+	// of moved elements.
+	template<typename Relocate = NoRelocation>
+	size_t CompactFor(std::chrono::microseconds budget, Relocate relocate = Relocate())
+	{
+		auto deadline = std::chrono::steady_clock::now() + budget;
+		size_t moved = 0, step;
+		// Reading the clock costs more than a move, so check it only every 64 moves.
+		do
+			moved += step = CompactStep<Relocate&>(64, relocate);
+		while (step == 64 && std::chrono::steady_clock::now() < deadline);
+		return moved;
+	}
+
+	// Calls fn for all used elements on the threads of pool and deletes the elements for which it
+	// returns true afterwards. fn is called concurrently for different elements and must not add or
+	// delete elements itself.
+	template<typename Fn>
+	void ParallelForEach(Fn fn, ThreadPool& pool)
+	{
+		sa_detail::ParallelPass<T>(pool, ParallelTasks(), [&](size_t task, std::vector<T*>& deleted)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el)) deleted.push_back(&el); });
+		}, [this](T *el) { Delete(el); });
+	}
 
-		--ChunkFill[i];
+	// Like ParallelForEach, but the outcome doesn't depend on the number of threads. fn(el, task) may
+	// update task.value and Spawn new elements. Returns the values of all tasks combined in order.
+	template<typename Acc, typename Fn, typename Combine = std::plus<Acc>>
+	Acc DeterministicForEach(Fn fn, ThreadPool& pool, Combine combine = Combine())
+	{
+		return sa_detail::DeterministicPass<T, Acc>(pool, ParallelTasks(), [&](size_t task, DeterministicTask<T, Acc>& state)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el, state)) state.deleted.push_back(&el); });
+		}, combine, [this](T *el) { Delete(el); }, [this](const T& el) { Emplace(el); });
 	}
 
 	template<typename Ti, typename SA = StaticChunkSA>
@@ -262,37 +2588,50 @@ public:
 	{
 		SA *array;
 		size_t i, j; // chunk, position in chunk
+		uint64_t cur; // remaining used bits in the occupancy word of j
 
-		Iterator& next(bool return_next)
+		// Moves to the first used element in chunk c, starting with occupancy word w whose remaining
+		// bits are m.
+		Iterator& next(size_t c, size_t w, uint64_t m)
 		{
-			for (; i < MaxChunk; i++, j = 0)
+			while (!m)
 			{
-				if (array->ChunkFill[i])
+				if (++w == ChunkWords || !array->ChunkFill[c])
 				{
-					for (; j < ChunkSize; j++)
+					// Skip empty chunks.
+					c = array->NonEmptyChunks.FindNextSet(c + 1);
+					if (c == array->NonEmptyChunks.npos)
 					{
-						if (array->UsedElements[i*ChunkSize + j] && return_next)
-							return *this;
-						return_next = true;
+						// We're at the end.
+						array = nullptr;
+						i = j = 0;
+						cur = 0;
+						return *this;
 					}
+					w = 0;
 				}
-				return_next = true;
+				m = array->Used[c][w];
 			}
-			// We're at the end.
-			array = nullptr;
-			i = j = 0;
+			i = c;
+			j = w*64 + __builtin_ctzll(m);
+			cur = m & (m - 1);
 			return *this;
 		}
 	public:
-		Iterator(SA *array) : array(array), i(0), j(0)
+		Iterator(SA *array) : array(array), i(0), j(0), cur(0)
 		{
 			if (array)
-				next(true);
+			{
+				if (array->ChunkFill[0])
+					next(0, 0, array->Used[0][0]);
+				else
+					next(0, ChunkWords - 1, 0);
+			}
 		}
 
 		Iterator& operator++()
 		{
-			return next(false);
+			return next(i, j / 64, cur);
 		}
 
 		bool operator==(Iterator other) { return array == other.array && i == other.i && j == other.j; }
@@ -306,510 +2645,1274 @@ public:
 	Iterator<const T, const StaticChunkSA> end() const { return Iterator<const T, const StaticChunkSA>(nullptr); }
 };
 
-template<typename T, size_t N>
+// Storage layouts for the linked list arrays. Links is the list metadata of a single element.
+
+// Stores each element's links right after its data.
+struct InterleavedLayout
+{
+	template<typename T, typename Links, size_t N>
+	class Storage
+	{
+		struct Element
+		{
+			// Elements are only constructed when they are in use.
+			union { T data; };
+			Links links;
+
+			Element() { }
+			~Element() { }
+		};
+		// We need this to be able to cast a T* to an Element*.
+		static_assert(std::is_standard_layout<Element>::value);
+
+		Element elements[N];
+
+	public:
+		T& Data(size_t i) { return elements[i].data; }
+		const T& Data(size_t i) const { return elements[i].data; }
+		Links& Link(size_t i) { return elements[i].links; }
+		const Links& Link(size_t i) const { return elements[i].links; }
+		size_t IndexOf(const T *el) const { return reinterpret_cast<const Element*>(el) - elements; }
+	};
+};
+
+// Stores links and data in separate arrays. List operations then don't touch payload cache lines
+// and iteration reads a dense payload array.
+struct SplitLayout
+{
+	template<typename T, typename Links, size_t N>
+	class Storage
+	{
+		// Elements are only constructed when they are in use.
+		union { T data[N]; };
+		Links links[N];
+
+	public:
+		Storage() { }
+		~Storage() { }
+
+		T& Data(size_t i) { return data[i]; }
+		const T& Data(size_t i) const { return data[i]; }
+		Links& Link(size_t i) { return links[i]; }
+		const Links& Link(size_t i) const { return links[i]; }
+		size_t IndexOf(const T *el) const { return el - data; }
+	};
+};
+
+// Linked lists of the used and the unused elements, both in memory order. An occupancy bitmap finds
+// the previous used or unused element a whole word at a time.
+template<typename T, size_t N, typename Layout = InterleavedLayout, typename Index = sa_detail::LinkIndex<N>>
 class LinkedListSA
 {
+	static_assert(N <= (Index) -1, "Index type too small for N");
 protected: // for tests
-	struct ListElement
+	// Marks the end of a list.
+	static constexpr Index None = (Index) -1;
+
+	struct Links
 	{
-		T data;
-		ListElement *next;
-		bool used = false;
+		Index next;
 	};
-	// We need this to be able to cast a T* to a ListElement*.
-	static_assert(std::is_standard_layout<ListElement>::value);
 
-	ListElement array[N];
-	ListElement *firstUsed, *firstFree;
+	typename Layout::template Storage<T, Links, N> storage;
+	Index firstUsed, firstFree;
+	// Elements starting at firstUntouched have never been used. They implicitly follow the last
+	// element of the free list.
+	size_t firstUntouched;
+	sa_detail::Bitmap<N> UsedElements;
+
+	T& Data(Index i) { return storage.Data(i); }
+	const T& Data(Index i) const { return storage.Data(i); }
+	Index& Next(Index i) { return storage.Link(i).next; }
+	Index Next(Index i) const { return storage.Link(i).next; }
+	Index IndexOf(T *el) const { return storage.IndexOf(el); }
 	
-	/*void PrintList(ListElement *start)
+	/*void PrintList(Index start)
 	{
-		for (auto it = start; it; it = it->next)
-			printf("%d -> ", it->data);
-		printf("nullptr\n");
+		for (auto it = start; it != None; it = Next(it))
+			printf("%d -> ", Data(it));
+		printf("None\n");
 	}*/
 
+	// Removes the first element from the free list. Elements which have never been used are only
+	// added to the free list when they are needed, so constructing the array is cheap.
+	Index TakeFree()
+	{
+		Index el = firstFree;
+		if (el != None)
+			firstFree = Next(el);
+		else if (firstUntouched < N)
+			el = firstUntouched++;
+		return el;
+	}
+
+	// Parallel passes split the elements into tasks of 4096 in memory order, regardless of the list
+	// order.
+	size_t ParallelTasks() const { return (firstUntouched + 4095) / 4096; }
+
+	template<typename Fn>
+	void ForEachInTask(size_t task, Fn fn)
+	{
+		for (size_t i = task * 4096; i < firstUntouched && i < task * 4096 + 4096; i++)
+			if (UsedElements[i])
+				fn(Data(i));
+	}
+
 public:
-	LinkedListSA() : firstUsed(nullptr), firstFree(array)
+	LinkedListSA() : firstUsed(None), firstFree(None), firstUntouched(0) { }
+
+	~LinkedListSA()
 	{
-		// Everything starts in the free list.
-		for (size_t i = 1; i < N; i++)
-			array[i-1].next = &array[i];
-		array[N-1].next = nullptr;
+		if (!std::is_trivially_destructible<T>::value)
+			for (T& el : *this)
+				el.~T();
 	}
 
 	T* New()
 	{
-		if (!firstFree) return nullptr;
-		ListElement *el = firstFree;
-		firstFree = el->next;
-		el->used = true;
+		return Emplace();
+	}
+
+	// Constructs a new element with the given arguments in an unused spot. Returns nullptr if the
+	// array is full.
+	template<typename... Args>
+	T* Emplace(Args&&... args)
+	{
+		Index el = TakeFree();
+		if (el == None) return nullptr;
+		UsedElements.set(el);
 
 		// The hard part is now to insert the element in the right place in the list. We could just
 		// put it in the front, but this would destroy cache locality during iteration.
-		if (firstUsed)
+		if (firstUsed != None)
 		{
-			ListElement *prevEl = el;
-			while (--prevEl >= array)
-				if (prevEl->used)
-				{
-					el->next = prevEl->next;
-					prevEl->next = el;
-					goto done;
-				}
+			size_t prevEl = UsedElements.FindPrevSet(el);
+			if (prevEl != UsedElements.npos)
+			{
+				Next(el) = Next(prevEl);
+				Next(prevEl) = el;
+				goto done;
+			}
 			// We're at the front.
-			el->next = firstUsed;
+			Next(el) = firstUsed;
 		}
 		else
-			el->next = nullptr;
+			Next(el) = None;
 		firstUsed = el;
 done:
-		return &el->data;
+		return sa_detail::Construct<T>(&Data(el), std::forward<Args>(args)...);
+	}
+
+	// Claims up to n unused elements in memory order and stores pointers to them in out. Returns the
+	// number of claimed elements.
+	size_t New(size_t n, T **out)
+	{
+		size_t count = 0;
+		while (count < n)
+		{
+			Index el = TakeFree();
+			if (el == None) break;
+			UsedElements.set(el);
+
+			// As the free list is ordered, the search ends at the element inserted before at the
+			// latest. For contiguous free elements, this is the same bitmap word.
+			size_t prevEl = UsedElements.FindPrevSet(el);
+			if (prevEl != UsedElements.npos)
+			{
+				Next(el) = Next(prevEl);
+				Next(prevEl) = el;
+			}
+			else
+			{
+				// We're at the front.
+				Next(el) = firstUsed;
+				firstUsed = el;
+			}
+			out[count++] = sa_detail::Construct<T>(&Data(el));
+		}
+		return count;
 	}
 
 	void Delete(T *dataEl)
 	{
-		ListElement *el = reinterpret_cast<ListElement*>(dataEl);
-		assert(el >= &array[0] && el < &array[N]);
-		assert(el->used);
-		el->used = false;
+		Index el = IndexOf(dataEl);
+		assert(el < firstUntouched);
+		assert(UsedElements[el]);
+		dataEl->~T();
+		UsedElements.reset(el);
 
-		ListElement *next = el->next;
-		bool lookingForUsed = false, lookingForFree = !!firstFree;
+		Index next = Next(el);
 		if (el == firstUsed)
 			firstUsed = next;
 		else
-			lookingForUsed = true;
+			Next(UsedElements.FindPrevSet(el)) = next;
+
+		if (firstFree != None)
+		{
+			size_t prevEl = UsedElements.FindPrevUnset(el);
+			if (prevEl != UsedElements.npos)
+			{
+				Next(el) = Next(prevEl);
+				Next(prevEl) = el;
+				return;
+			}
+		}
+		Next(el) = firstFree;
+		firstFree = el;
+	}
 
-		ListElement *prevEl = el;
-		while (--prevEl >= array && (lookingForUsed || lookingForFree))
+	// Calls pred for all used elements in memory order and deletes the elements for which it returns
+	// true. pred must not add or delete elements itself.
+	template<typename Pred>
+	void RemoveIf(Pred pred)
+	{
+		// Removed elements come in memory order, so they can be merged into the free list in a
+		// single pass.
+		Index *usedLink = &firstUsed, *freeLink = &firstFree;
+		for (Index el = firstUsed, next; el != None; el = next)
 		{
-			if (lookingForUsed && prevEl->used)
+			next = Next(el);
+			if (pred(Data(el)))
 			{
-				prevEl->next = next;
-				lookingForUsed = false;
+				Data(el).~T();
+				UsedElements.reset(el);
+				*usedLink = next;
+				while (*freeLink != None && *freeLink < el)
+					freeLink = &Next(*freeLink);
+				Next(el) = *freeLink;
+				*freeLink = el;
+				freeLink = &Next(el);
 			}
-			if (lookingForFree && !prevEl->used)
+			else
+				usedLink = &Next(el);
+		}
+	}
+
+	// Returns the share of unused spots before the last used element, from 0 to 1. A high value means
+	// that the list jumps around in memory, so Compact pays off.
+	double Fragmentation() const
+	{
+		size_t used = 0;
+		Index last = None;
+		for (Index el = firstUsed; el != None; el = Next(el), used++)
+			last = el;
+		return used ? 1 - (double) used / (last + 1) : 0;
+	}
+
+	// Moves the used elements into the lowest unused spots, keeping their order, and calls
+	// relocate(from, to) for each move. Returns the number of moved elements. Pointers to moved
+	// elements become invalid, so this must not be called during iteration.
+	template<typename Relocate = NoRelocation>
+	size_t Compact(Relocate relocate = Relocate())
+	{
+		Index to = 0;
+		size_t moved = 0;
+		for (Index el = firstUsed, next; el != None; el = next, to++)
+		{
+			next = Next(el);
+			if (el != to)
 			{
-				el->next = prevEl->next;
-				prevEl->next = el;
-				lookingForFree = false;
+				sa_detail::MoveElement(&Data(el), &Data(to), relocate);
+				UsedElements.reset(el);
+				UsedElements.set(to);
+				moved++;
 			}
+			Next(to) = next != None ? to + 1 : None;
+		}
+		firstUsed = to ? 0 : None;
+		// All elements after the used ones are unused, so they can be handed out like untouched ones.
+		firstFree = None;
+		firstUntouched = to;
+		return moved;
+	}
+
+	// Calls fn for all used elements on the threads of pool and deletes the elements for which it
+	// returns true afterwards. fn is called concurrently for different elements and must not add or
+	// delete elements itself.
+	template<typename Fn>
+	void ParallelForEach(Fn fn, ThreadPool& pool)
+	{
+		sa_detail::ParallelPass<T>(pool, ParallelTasks(), [&](size_t task, std::vector<T*>& deleted)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el)) deleted.push_back(&el); });
+		}, [this](T *el) { Delete(el); });
+	}
+
+	// Like ParallelForEach, but the outcome doesn't depend on the number of threads. fn(el, task) may
+	// update task.value and Spawn new elements. Returns the values of all tasks combined in order.
+	template<typename Acc, typename Fn, typename Combine = std::plus<Acc>>
+	Acc DeterministicForEach(Fn fn, ThreadPool& pool, Combine combine = Combine())
+	{
+		return sa_detail::DeterministicPass<T, Acc>(pool, ParallelTasks(), [&](size_t task, DeterministicTask<T, Acc>& state)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el, state)) state.deleted.push_back(&el); });
+		}, combine, [this](T *el) { Delete(el); }, [this](const T& el) { Emplace(el); });
+	}
+
+	template<typename Ti, typename SA = LinkedListSA>
+	class Iterator : public std::iterator<std::forward_iterator_tag, Ti>
+	{
+		SA *array;
+		// We need to save the next element explicitly to allow deletion during iteration.
+		Index el, next;
+	public:
+		Iterator(SA *array) : array(array), el(array ? array->firstUsed : None), next(el != None ? array->Next(el) : None) { }
+
+		Iterator& operator++()
+		{
+			el = next;
+			next = el != None ? array->Next(el) : None;
+			return *this;
+		}
+
+		bool operator==(Iterator other) { return el == other.el; }
+		bool operator!=(Iterator other) { return !(*this == other); }
+		Ti& operator*() const { return array->Data(el); }
+	};
+
+	Iterator<T> begin() { return Iterator<T>(this); }
+	Iterator<T> end() { return Iterator<T>(nullptr); }
+	Iterator<const T, const LinkedListSA> begin() const { return Iterator<const T, const LinkedListSA>(this); }
+	Iterator<const T, const LinkedListSA> end() const { return Iterator<const T, const LinkedListSA>(nullptr); }
+};
+
+template<typename T, size_t N, typename Layout, typename Index>
+constexpr Index LinkedListSA<T, N, Layout, Index>::None;
+
+// LinkedListSA used to mark used elements with a flag next to their links and LinkedListBitmapSA
+// with a separate bitmap. Both use the occupancy bitmap now, so they share the implementation.
+template<typename T, size_t N, typename Layout = InterleavedLayout, typename Index = sa_detail::LinkIndex<N>>
+class LinkedListBitmapSA : public LinkedListSA<T, N, Layout, Index>
+{
+};
+
+template<typename T, size_t N, typename Layout = InterleavedLayout, typename Index = sa_detail::LinkIndex<N>>
+class UnorderedLinkedListSA
+{
+	static_assert(N <= (Index) -1, "Index type too small for N");
+protected: // for tests
+	// Marks the end of a list.
+	static constexpr Index None = (Index) -1;
+
+	struct Links
+	{
+		Index next;
+		bool used;
+	};
+
+	typename Layout::template Storage<T, Links, N> storage;
+	Index firstUsed, firstFree;
+	// Elements starting at firstUntouched have never been used. They implicitly follow the last
+	// element of the free list.
+	size_t firstUntouched;
+
+	T& Data(Index i) { return storage.Data(i); }
+	const T& Data(Index i) const { return storage.Data(i); }
+	Index& Next(Index i) { return storage.Link(i).next; }
+	Index Next(Index i) const { return storage.Link(i).next; }
+	bool& Used(Index i) { return storage.Link(i).used; }
+	Index IndexOf(T *el) const { return storage.IndexOf(el); }
+	
+	/*void PrintList(Index start)
+	{
+		for (auto it = start; it != None; it = Next(it))
+			printf("%d -> ", Data(it));
+		printf("None\n");
+	}*/
+
+	// Removes the first element from the free list. Elements which have never been used are only
+	// added to the free list when they are needed, so constructing the array is cheap.
+	Index TakeFree()
+	{
+		Index el = firstFree;
+		if (el != None)
+			firstFree = Next(el);
+		else if (firstUntouched < N)
+			el = firstUntouched++;
+		return el;
+	}
+
+	// Parallel passes split the elements into tasks of 4096 in memory order, regardless of the list
+	// order.
+	size_t ParallelTasks() const { return (firstUntouched + 4095) / 4096; }
+
+	template<typename Fn>
+	void ForEachInTask(size_t task, Fn fn)
+	{
+		for (size_t i = task * 4096; i < firstUntouched && i < task * 4096 + 4096; i++)
+			if (Used(i))
+				fn(Data(i));
+	}
+
+public:
+	UnorderedLinkedListSA() : firstUsed(None), firstFree(None), firstUntouched(0) { }
+
+	~UnorderedLinkedListSA()
+	{
+		if (!std::is_trivially_destructible<T>::value)
+			for (T& el : *this)
+				el.~T();
+	}
+
+	T* New()
+	{
+		return Emplace();
+	}
+
+	// Constructs a new element with the given arguments in an unused spot. Returns nullptr if the
+	// array is full.
+	template<typename... Args>
+	T* Emplace(Args&&... args)
+	{
+		Index el = TakeFree();
+		if (el == None) return nullptr;
+		Used(el) = true;
+		// Instead of keeping order, we just prepend the new element to the list.
+		Next(el) = firstUsed;
+		firstUsed = el;
+		return sa_detail::Construct<T>(&Data(el), std::forward<Args>(args)...);
+	}
+
+	// Claims up to n unused elements and stores pointers to them in out. Returns the number of
+	// claimed elements.
+	size_t New(size_t n, T **out)
+	{
+		size_t count = 0;
+		while (count < n && (out[count] = New()))
+			count++;
+		return count;
+	}
+
+	void Delete(T *dataEl)
+	{
+		Index el = IndexOf(dataEl);
+		assert(el < firstUntouched);
+		assert(Used(el));
+		dataEl->~T();
+		Used(el) = false;
+
+		Index next = Next(el);
+		if (el == firstUsed)
+			firstUsed = next;
+		else
+		{
+			for (Index prevEl = firstUsed; prevEl != None; prevEl = Next(prevEl))
+				if (Next(prevEl) == el)
+				{
+					Next(prevEl) = next;
+					break;
+				}
 		}
+		Next(el) = firstFree;
+		firstFree = el;
+	}
 
-		if (!!firstFree == lookingForFree)
+	// Calls pred for all used elements and deletes the elements for which it returns
+	// true. pred must not add or delete elements itself.
+	template<typename Pred>
+	void RemoveIf(Pred pred)
+	{
+		Index *usedLink = &firstUsed;
+		for (Index el = firstUsed, next; el != None; el = next)
 		{
-			if (firstFree)
-				el->next = firstFree;
+			next = Next(el);
+			if (pred(Data(el)))
+			{
+				Data(el).~T();
+				Used(el) = false;
+				*usedLink = next;
+				Next(el) = firstFree;
+				firstFree = el;
+			}
 			else
-				el->next = nullptr;
-			firstFree = el;
+				usedLink = &Next(el);
 		}
 	}
 
-	template<typename Ti, typename SA = LinkedListSA>
+	// Calls fn for all used elements on the threads of pool and deletes the elements for which it
+	// returns true afterwards. fn is called concurrently for different elements and must not add or
+	// delete elements itself.
+	template<typename Fn>
+	void ParallelForEach(Fn fn, ThreadPool& pool)
+	{
+		sa_detail::ParallelPass<T>(pool, ParallelTasks(), [&](size_t task, std::vector<T*>& deleted)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el)) deleted.push_back(&el); });
+		}, [this](T *el) { Delete(el); });
+	}
+
+	// Like ParallelForEach, but the outcome doesn't depend on the number of threads. fn(el, task) may
+	// update task.value and Spawn new elements. Returns the values of all tasks combined in order.
+	template<typename Acc, typename Fn, typename Combine = std::plus<Acc>>
+	Acc DeterministicForEach(Fn fn, ThreadPool& pool, Combine combine = Combine())
+	{
+		return sa_detail::DeterministicPass<T, Acc>(pool, ParallelTasks(), [&](size_t task, DeterministicTask<T, Acc>& state)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el, state)) state.deleted.push_back(&el); });
+		}, combine, [this](T *el) { Delete(el); }, [this](const T& el) { Emplace(el); });
+	}
+
+	template<typename Ti, typename SA = UnorderedLinkedListSA>
 	class Iterator : public std::iterator<std::forward_iterator_tag, Ti>
 	{
+		SA *array;
 		// We need to save the next element explicitly to allow deletion during iteration.
-		ListElement *el, *next;
+		Index el, next;
 	public:
-		Iterator(SA *array) : el(array ? array->firstUsed : nullptr), next(el ? el->next : nullptr) { }
+		Iterator(SA *array) : array(array), el(array ? array->firstUsed : None), next(el != None ? array->Next(el) : None) { }
 
 		Iterator& operator++()
 		{
 			el = next;
-			next = el ? el->next : nullptr;
+			next = el != None ? array->Next(el) : None;
 			return *this;
 		}
 
 		bool operator==(Iterator other) { return el == other.el; }
 		bool operator!=(Iterator other) { return !(*this == other); }
-		Ti& operator*() const { return el->data; }
+		Ti& operator*() const { return array->Data(el); }
 	};
 
 	Iterator<T> begin() { return Iterator<T>(this); }
 	Iterator<T> end() { return Iterator<T>(nullptr); }
-	Iterator<const T, const LinkedListSA> begin() const { return Iterator<const T, const LinkedListSA>(this); }
-	Iterator<const T, const LinkedListSA> end() const { return Iterator<const T, const LinkedListSA>(nullptr); }
+	Iterator<const T, const UnorderedLinkedListSA> begin() const { return Iterator<const T, const UnorderedLinkedListSA>(this); }
+	Iterator<const T, const UnorderedLinkedListSA> end() const { return Iterator<const T, const UnorderedLinkedListSA>(nullptr); }
 };
 
-template<typename T, size_t N>
-class LinkedListBitmapSA
+template<typename T, size_t N, typename Layout, typename Index>
+constexpr Index UnorderedLinkedListSA<T, N, Layout, Index>::None;
+
+template<typename T, size_t N, typename Layout = InterleavedLayout, typename Index = sa_detail::LinkIndex<N>>
+class DoubleLinkedListSA
 {
+	static_assert(N <= (Index) -1, "Index type too small for N");
 protected: // for tests
-	struct ListElement
+	// Marks the end of a list.
+	static constexpr Index None = (Index) -1;
+
+	struct Links
 	{
-		T data;
-		ListElement *next;
+		// prev is only valid while the element is used.
+		Index next, prev;
 	};
-	// We need this to be able to cast a T* to a ListElement*.
-	static_assert(std::is_standard_layout<ListElement>::value);
 
-	ListElement array[N];
-	ListElement *firstUsed, *firstFree;
-	std::bitset<N> UsedElements;
+	typename Layout::template Storage<T, Links, N> storage;
+	sa_detail::Bitmap<N> UsedElements;
+	Index firstUsed, firstFree;
+	// Elements starting at firstUntouched have never been used. They implicitly follow the last
+	// element of the free list.
+	size_t firstUntouched;
+
+	T& Data(Index i) { return storage.Data(i); }
+	const T& Data(Index i) const { return storage.Data(i); }
+	Index& Next(Index i) { return storage.Link(i).next; }
+	Index Next(Index i) const { return storage.Link(i).next; }
+	Index& Prev(Index i) { return storage.Link(i).prev; }
+	Index IndexOf(T *el) const { return storage.IndexOf(el); }
 	
-	/*void PrintList(ListElement *start)
+	/*void PrintList(Index start)
 	{
-		for (auto it = start; it; it = it->next)
-			printf("%d -> ", it->data);
-		printf("nullptr\n");
+		for (auto it = start; it != None; it = Next(it))
+			printf("%d -> ", Data(it));
+		printf("None\n");
 	}*/
 
+	// Removes the first element from the free list. Elements which have never been used are only
+	// added to the free list when they are needed, so constructing the array is cheap.
+	Index TakeFree()
+	{
+		Index el = firstFree;
+		if (el != None)
+			firstFree = Next(el);
+		else if (firstUntouched < N)
+			el = firstUntouched++;
+		return el;
+	}
+
+	// Parallel passes split the elements into tasks of 4096 in memory order, regardless of the list
+	// order.
+	size_t ParallelTasks() const { return (firstUntouched + 4095) / 4096; }
+
+	template<typename Fn>
+	void ForEachInTask(size_t task, Fn fn)
+	{
+		for (size_t i = task * 4096; i < firstUntouched && i < task * 4096 + 4096; i++)
+			if (UsedElements[i])
+				fn(Data(i));
+	}
+
 public:
-	LinkedListBitmapSA() : firstUsed(nullptr), firstFree(array)
+	DoubleLinkedListSA() : firstUsed(None), firstFree(None), firstUntouched(0) { }
+
+	~DoubleLinkedListSA()
 	{
-		// Everything starts in the free list.
-		for (size_t i = 1; i < N; i++)
-			array[i-1].next = &array[i];
-		array[N-1].next = nullptr;
+		if (!std::is_trivially_destructible<T>::value)
+			for (T& el : *this)
+				el.~T();
 	}
 
 	T* New()
 	{
-		if (!firstFree) return nullptr;
-		ListElement *el = firstFree;
-		firstFree = el->next;
-		UsedElements.set(el - array);
+		return Emplace();
+	}
+
+	// Constructs a new element with the given arguments in an unused spot. Returns nullptr if the
+	// array is full.
+	template<typename... Args>
+	T* Emplace(Args&&... args)
+	{
+		Index el = TakeFree();
+		if (el == None) return nullptr;
+		UsedElements.set(el);
 
 		// The hard part is now to insert the element in the right place in the list. We could just
 		// put it in the front, but this would destroy cache locality during iteration.
-		if (firstUsed)
+		if (firstUsed != None)
 		{
-			ListElement *prevEl = el;
-			while (--prevEl >= array)
-				if (UsedElements[prevEl - array])
-				{
-					el->next = prevEl->next;
-					prevEl->next = el;
-					goto done;
-				}
+			size_t prevEl = UsedElements.FindPrevSet(el);
+			if (prevEl != UsedElements.npos)
+			{
+				Next(el) = Next(prevEl);
+				Prev(el) = prevEl;
+				Next(prevEl) = el;
+				if (Next(el) != None)
+					Prev(Next(el)) = el;
+				goto done;
+			}
 			// We're at the front.
-			el->next = firstUsed;
+			Next(el) = firstUsed;
+			Prev(firstUsed) = el;
 		}
 		else
-			el->next = nullptr;
+			Next(el) = None;
 		firstUsed = el;
+		Prev(el) = None;
 done:
-		return &el->data;
+		return sa_detail::Construct<T>(&Data(el), std::forward<Args>(args)...);
+	}
+
+	// Claims up to n unused elements in memory order and stores pointers to them in out. Returns the
+	// number of claimed elements.
+	size_t New(size_t n, T **out)
+	{
+		size_t count = 0;
+		while (count < n)
+		{
+			Index el = TakeFree();
+			if (el == None) break;
+			UsedElements.set(el);
+
+			// As the free list is ordered, the search ends at the element inserted before at the
+			// latest. For contiguous free elements, this is the same bitmap word.
+			size_t prevEl = UsedElements.FindPrevSet(el);
+			if (prevEl != UsedElements.npos)
+			{
+				Next(el) = Next(prevEl);
+				Prev(el) = prevEl;
+				Next(prevEl) = el;
+			}
+			else
+			{
+				// We're at the front.
+				Next(el) = firstUsed;
+				Prev(el) = None;
+				firstUsed = el;
+			}
+			if (Next(el) != None)
+				Prev(Next(el)) = el;
+			out[count++] = sa_detail::Construct<T>(&Data(el));
+		}
+		return count;
 	}
 
 	void Delete(T *dataEl)
 	{
-		ListElement *el = reinterpret_cast<ListElement*>(dataEl);
-		assert(el >= &array[0] && el < &array[N]);
-		assert(UsedElements[el - array]);
-		UsedElements.reset(el - array);
+		Index el = IndexOf(dataEl);
+		assert(el < firstUntouched);
+		assert(UsedElements[el]);
+		dataEl->~T();
+		UsedElements.reset(el);
 
-		ListElement *next = el->next;
-		bool lookingForUsed = false, lookingForFree = !!firstFree;
+		Index next = Next(el), prev = Prev(el);
 		if (el == firstUsed)
 			firstUsed = next;
-		else
-			lookingForUsed = true;
+		if (next != None)
+			Prev(next) = prev;
+		if (prev != None)
+			Next(prev) = next;
+
+		if (firstFree != None)
+		{
+			size_t prevEl = UsedElements.FindPrevUnset(el);
+			if (prevEl != UsedElements.npos)
+			{
+				Next(el) = Next(prevEl);
+				Next(prevEl) = el;
+				return;
+			}
+		}
+		Next(el) = firstFree;
+		firstFree = el;
+	}
 
-		ListElement *prevEl = el;
-		while (--prevEl >= array && (lookingForUsed || lookingForFree))
+	// Calls pred for all used elements in memory order and deletes the elements for which it returns
+	// true. pred must not add or delete elements itself.
+	template<typename Pred>
+	void RemoveIf(Pred pred)
+	{
+		// Removed elements come in memory order, so they can be merged into the free list in a
+		// single pass.
+		Index *usedLink = &firstUsed, *freeLink = &firstFree;
+		Index prevUsed = None;
+		for (Index el = firstUsed, next; el != None; el = next)
 		{
-			if (lookingForUsed && UsedElements[prevEl - array])
+			next = Next(el);
+			if (pred(Data(el)))
 			{
-				prevEl->next = next;
-				lookingForUsed = false;
+				Data(el).~T();
+				UsedElements.reset(el);
+				*usedLink = next;
+				while (*freeLink != None && *freeLink < el)
+					freeLink = &Next(*freeLink);
+				Next(el) = *freeLink;
+				*freeLink = el;
+				freeLink = &Next(el);
 			}
-			if (lookingForFree && !UsedElements[prevEl - array])
+			else
 			{
-				el->next = prevEl->next;
-				prevEl->next = el;
-				lookingForFree = false;
+				Prev(el) = prevUsed;
+				prevUsed = el;
+				usedLink = &Next(el);
 			}
 		}
+	}
 
-		if (!!firstFree == lookingForFree)
+	// Returns the share of unused spots before the last used element, from 0 to 1. A high value means
+	// that the list jumps around in memory, so Compact pays off.
+	double Fragmentation() const
+	{
+		size_t used = 0;
+		Index last = None;
+		for (Index el = firstUsed; el != None; el = Next(el), used++)
+			last = el;
+		return used ? 1 - (double) used / (last + 1) : 0;
+	}
+
+	// Moves the used elements into the lowest unused spots, keeping their order, and calls
+	// relocate(from, to) for each move. Returns the number of moved elements. Pointers to moved
+	// elements become invalid, so this must not be called during iteration.
+	template<typename Relocate = NoRelocation>
+	size_t Compact(Relocate relocate = Relocate())
+	{
+		Index to = 0;
+		size_t moved = 0;
+		for (Index el = firstUsed, next; el != None; el = next, to++)
 		{
-			if (firstFree)
-				el->next = firstFree;
-			else
-				el->next = nullptr;
-			firstFree = el;
+			next = Next(el);
+			if (el != to)
+			{
+				sa_detail::MoveElement(&Data(el), &Data(to), relocate);
+				UsedElements.reset(el);
+				UsedElements.set(to);
+				moved++;
+			}
+			Next(to) = next != None ? to + 1 : None;
+			Prev(to) = to ? to - 1 : None;
 		}
+		firstUsed = to ? 0 : None;
+		// All elements after the used ones are unused, so they can be handed out like untouched ones.
+		firstFree = None;
+		firstUntouched = to;
+		return moved;
+	}
+
+	// Calls fn for all used elements on the threads of pool and deletes the elements for which it
+	// returns true afterwards. fn is called concurrently for different elements and must not add or
+	// delete elements itself.
+	template<typename Fn>
+	void ParallelForEach(Fn fn, ThreadPool& pool)
+	{
+		sa_detail::ParallelPass<T>(pool, ParallelTasks(), [&](size_t task, std::vector<T*>& deleted)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el)) deleted.push_back(&el); });
+		}, [this](T *el) { Delete(el); });
+	}
+
+	// Like ParallelForEach, but the outcome doesn't depend on the number of threads. fn(el, task) may
+	// update task.value and Spawn new elements. Returns the values of all tasks combined in order.
+	template<typename Acc, typename Fn, typename Combine = std::plus<Acc>>
+	Acc DeterministicForEach(Fn fn, ThreadPool& pool, Combine combine = Combine())
+	{
+		return sa_detail::DeterministicPass<T, Acc>(pool, ParallelTasks(), [&](size_t task, DeterministicTask<T, Acc>& state)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el, state)) state.deleted.push_back(&el); });
+		}, combine, [this](T *el) { Delete(el); }, [this](const T& el) { Emplace(el); });
 	}
 
-	template<typename Ti, typename SA = LinkedListBitmapSA>
+	template<typename Ti, typename SA = DoubleLinkedListSA>
 	class Iterator : public std::iterator<std::forward_iterator_tag, Ti>
 	{
+		SA *array;
 		// We need to save the next element explicitly to allow deletion during iteration.
-		ListElement *el, *next;
+		Index el, next;
 	public:
-		Iterator(SA *array) : el(array ? array->firstUsed : nullptr), next(el ? el->next : nullptr) { }
+		Iterator(SA *array) : array(array), el(array ? array->firstUsed : None), next(el != None ? array->Next(el) : None) { }
 
 		Iterator& operator++()
 		{
 			el = next;
-			next = el ? el->next : nullptr;
+			next = el != None ? array->Next(el) : None;
 			return *this;
 		}
 
 		bool operator==(Iterator other) { return el == other.el; }
 		bool operator!=(Iterator other) { return !(*this == other); }
-		Ti& operator*() const { return el->data; }
+		Ti& operator*() const { return array->Data(el); }
 	};
 
 	Iterator<T> begin() { return Iterator<T>(this); }
 	Iterator<T> end() { return Iterator<T>(nullptr); }
-	Iterator<const T, const LinkedListBitmapSA> begin() const { return Iterator<const T, const LinkedListBitmapSA>(this); }
-	Iterator<const T, const LinkedListBitmapSA> end() const { return Iterator<const T, const LinkedListBitmapSA>(nullptr); }
+	Iterator<const T, const DoubleLinkedListSA> begin() const { return Iterator<const T, const DoubleLinkedListSA>(this); }
+	Iterator<const T, const DoubleLinkedListSA> end() const { return Iterator<const T, const DoubleLinkedListSA>(nullptr); }
 };
 
-template<typename T, size_t N>
-class UnorderedLinkedListSA
-{
-protected: // for tests
-	struct ListElement
-	{
-		T data;
-		ListElement *next;
-		bool used = false;
-	};
-	// We need this to be able to cast a T* to a ListElement*.
-	static_assert(std::is_standard_layout<ListElement>::value);
+template<typename T, size_t N, typename Layout, typename Index>
+constexpr Index DoubleLinkedListSA<T, N, Layout, Index>::None;
 
-	ListElement array[N];
-	ListElement *firstUsed, *firstFree;
-	
-	/*void PrintList(ListElement *start)
+// The Relocate policy is called as relocate(from, to) whenever an element moves, so that external
+// indices can be updated. Any callable works, e.g. std::function<void(T*, T*)>.
+template<typename T, size_t N, typename Storage = InlineStorage, typename Relocate = NoRelocation>
+class ReorderingSA
+{
+	typename Storage::template Array<T, N> storage;
+	T *firstFree = storage.Data();
+	Relocate relocate;
+	// Positions of elements deleted while deferring.
+	std::vector<size_t> deferred;
+	bool deferring = false;
+
+	// Parallel passes split the array into tasks of 4096 elements.
+	size_t ParallelTasks() const { return (firstFree - storage.Data() + 4095) / 4096; }
+
+	template<typename Fn>
+	void ForEachInTask(size_t task, Fn fn)
 	{
-		for (auto it = start; it; it = it->next)
-			printf("%d -> ", it->data);
-		printf("nullptr\n");
-	}*/
+		size_t used = firstFree - storage.Data();
+		for (size_t i = task * 4096; i < used && i < task * 4096 + 4096; i++)
+			fn(storage.Data()[i]);
+	}
 
 public:
-	UnorderedLinkedListSA() : firstUsed(nullptr), firstFree(array)
+	ReorderingSA() { }
+	explicit ReorderingSA(Relocate relocate) : relocate(std::move(relocate)) { }
+
+	~ReorderingSA()
 	{
-		// Everything starts in the free list.
-		for (size_t i = 1; i < N; i++)
-			array[i-1].next = &array[i];
-		array[N-1].next = nullptr;
+		for (T *el = storage.Data(); el < firstFree; el++)
+			el->~T();
 	}
 
 	T* New()
 	{
-		if (!firstFree) return nullptr;
-		ListElement *el = firstFree;
-		firstFree = el->next;
-		el->used = true;
-		// Instead of keeping order, we just prepend the new element to the list.
-		el->next = firstUsed;
-		firstUsed = el;
-		return &el->data;
+		return Emplace();
 	}
 
-	void Delete(T *dataEl)
+	// Constructs a new element with the given arguments in an unused spot. Returns nullptr if the
+	// array is full.
+	template<typename... Args>
+	T* Emplace(Args&&... args)
 	{
-		ListElement *el = reinterpret_cast<ListElement*>(dataEl);
-		assert(el >= &array[0] && el < &array[N]);
-		assert(el->used);
-		el->used = false;
-
-		ListElement *next = el->next;
-		if (el == firstUsed)
-			firstUsed = next;
-		else
+		T *data = storage.Data();
+		if (firstFree < data + N)
 		{
-			for (ListElement *prevEl = firstUsed; prevEl; prevEl = prevEl->next)
-				if (prevEl->next == el)
-				{
-					prevEl->next = next;
-					break;
-				}
+			storage.Commit(firstFree - data + 1);
+			return sa_detail::Construct<T>(firstFree++, std::forward<Args>(args)...);
 		}
-		el->next = firstFree;
-		firstFree = el;
+		return nullptr;
 	}
 
-	template<typename Ti, typename SA = UnorderedLinkedListSA>
-	class Iterator : public std::iterator<std::forward_iterator_tag, Ti>
+	// Claims up to n unused elements and stores pointers to them in out. Returns the number of
+	// claimed elements.
+	size_t New(size_t n, T **out)
 	{
-		// We need to save the next element explicitly to allow deletion during iteration.
-		ListElement *el, *next;
-	public:
-		Iterator(SA *array) : el(array ? array->firstUsed : nullptr), next(el ? el->next : nullptr) { }
+		T *data = storage.Data();
+		size_t used = firstFree - data;
+		if (n > N - used)
+			n = N - used;
+		storage.Commit(used + n);
+		for (size_t i = 0; i < n; i++)
+			out[i] = sa_detail::Construct<T>(firstFree++);
+		return n;
+	}
 
-		Iterator& operator++()
+	void Delete(T *el)
+	{
+		assert(el >= storage.Data() && el < firstFree);
+		if (deferring)
 		{
-			el = next;
-			next = el ? el->next : nullptr;
-			return *this;
+			deferred.push_back(el - storage.Data());
+			return;
 		}
+		auto lastUsed = firstFree - 1;
+		el->~T();
+		if (el != lastUsed)
+			sa_detail::MoveElement(lastUsed, el, relocate);
+		firstFree--;
+		storage.Release(firstFree - storage.Data());
+	}
 
-		bool operator==(Iterator other) { return el == other.el; }
-		bool operator!=(Iterator other) { return !(*this == other); }
-		Ti& operator*() const { return el->data; }
-	};
-
-	Iterator<T> begin() { return Iterator<T>(this); }
-	Iterator<T> end() { return Iterator<T>(nullptr); }
-	Iterator<const T, const UnorderedLinkedListSA> begin() const { return Iterator<const T, const UnorderedLinkedListSA>(this); }
-	Iterator<const T, const UnorderedLinkedListSA> end() const { return Iterator<const T, const UnorderedLinkedListSA>(nullptr); }
-};
-
-template<typename T, size_t N>
-class DoubleLinkedListSA
-{
-protected: // for tests
-	struct ListElement
+	// Calls pred for all used elements and deletes the elements for which it returns true. pred must
+	// not add or delete elements itself.
+	template<typename Pred>
+	void RemoveIf(Pred pred)
 	{
-		T data;
-		// prev is only valid while the element is used.
-		ListElement *next, *prev;
-		bool used = false;
-	};
-	// We need this to be able to cast a T* to a ListElement*.
-	static_assert(std::is_standard_layout<ListElement>::value);
+		// Like Delete, this moves the last element into the hole, which is then visited next.
+		for (T *el = storage.Data(); el < firstFree; )
+			if (pred(*el))
+			{
+				el->~T();
+				if (el != --firstFree)
+					sa_detail::MoveElement(firstFree, el, relocate);
+			}
+			else
+				el++;
+		storage.Release(firstFree - storage.Data());
+	}
 
-	ListElement array[N];
-	ListElement *firstUsed, *firstFree;
-	
-	/*void PrintList(ListElement *start)
+	// Calls fn for all used elements on the threads of pool and deletes the elements for which it
+	// returns true afterwards. fn is called concurrently for different elements and must not add or
+	// delete elements itself.
+	template<typename Fn>
+	void ParallelForEach(Fn fn, ThreadPool& pool)
 	{
-		for (auto it = start; it; it = it->next)
-			printf("%d -> ", it->data);
-		printf("nullptr\n");
-	}*/
+		sa_detail::ParallelPass<T>(pool, ParallelTasks(), [&](size_t task, std::vector<T*>& deleted)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el)) deleted.push_back(&el); });
+		}, [this](T *el) { Delete(el); });
+	}
 
-public:
-	DoubleLinkedListSA() : firstUsed(nullptr), firstFree(array)
+	// Like ParallelForEach, but the outcome doesn't depend on the number of threads. fn(el, task) may
+	// update task.value and Spawn new elements. Returns the values of all tasks combined in order.
+	template<typename Acc, typename Fn, typename Combine = std::plus<Acc>>
+	Acc DeterministicForEach(Fn fn, ThreadPool& pool, Combine combine = Combine())
 	{
-		// Everything starts in the free list.
-		for (size_t i = 1; i < N; i++)
-			array[i-1].next = &array[i];
-		array[N-1].next = nullptr;
+		return sa_detail::DeterministicPass<T, Acc>(pool, ParallelTasks(), [&](size_t task, DeterministicTask<T, Acc>& state)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el, state)) state.deleted.push_back(&el); });
+		}, combine, [this](T *el) { Delete(el); }, [this](const T& el) { Emplace(el); });
 	}
 
-	T* New()
+	// Range over the used elements as plain pointers, for loops which delete elements. While the range
+	// exists, Delete only records the element, which stays in place. Destroying the range calls Flush.
+	class DeferredRange
 	{
-		if (!firstFree) return nullptr;
-		ListElement *el = firstFree;
-		firstFree = el->next;
-		el->used = true;
+		ReorderingSA *array;
+		T *first, *last;
 
-		// The hard part is now to insert the element in the right place in the list. We could just
-		// put it in the front, but this would destroy cache locality during iteration.
-		if (firstUsed)
+	public:
+		explicit DeferredRange(ReorderingSA *array) : array(array), first(array->storage.Data()), last(array->firstFree)
 		{
-			ListElement *prevEl = el;
-			while (--prevEl >= array)
-				if (prevEl->used)
-				{
-					el->next = prevEl->next;
-					el->prev = prevEl;
-					prevEl->next = el;
-					if (el->next)
-						el->next->prev = el;
-					goto done;
-				}
-			// We're at the front.
-			el->next = firstUsed;
-			el->next->prev = el;
+			array->deferring = true;
 		}
-		else
-			el->next = nullptr;
-		firstUsed = el;
-		el->prev = nullptr;
-done:
-		return &el->data;
-	}
 
-	void Delete(T *dataEl)
-	{
-		ListElement *el = reinterpret_cast<ListElement*>(dataEl);
-		assert(el >= &array[0] && el < &array[N]);
-		assert(el->used);
-		el->used = false;
+		DeferredRange(DeferredRange&& other) : array(other.array), first(other.first), last(other.last)
+		{
+			other.array = nullptr;
+		}
 
-		ListElement *next = el->next;
-		if (el == firstUsed)
-			firstUsed = next;
-		if (next)
-			next->prev = el->prev;
-		if (el->prev)
-			el->prev->next = next;
+		~DeferredRange()
+		{
+			if (array)
+				array->Flush();
+		}
+
+		T* begin() const { return first; }
+		T* end() const { return last; }
+	};
+
+	// Defers deletions until the returned range is destroyed, e.g. at the end of a range-based for
+	// loop. Each element may only be deleted once.
+	DeferredRange Deferred()
+	{
+		return DeferredRange(this);
+	}
 
-		if (firstFree)
+	// Removes the elements deleted since Deferred() in one pass. The holes are filled with the last
+	// elements which aren't deleted themselves.
+	void Flush()
+	{
+		deferring = false;
+		if (deferred.empty())
+			return;
+		T *data = storage.Data();
+		std::sort(deferred.begin(), deferred.end());
+		for (size_t pos : deferred)
+			data[pos].~T();
+		size_t end = firstFree - data, front = 0, back = deferred.size();
+		while (front < back)
 		{
-			ListElement *prevEl = el;
-			while (--prevEl >= array)
+			size_t last = --end;
+			// The last element may be one of the holes itself.
+			if (last == deferred[back - 1])
 			{
-				if (!prevEl->used)
-				{
-					el->next = prevEl->next;
-					prevEl->next = el;
-					return;
-				}
+				back--;
+				continue;
 			}
-			el->next = firstFree;
+			size_t hole = deferred[front++];
+			sa_detail::MoveElement(&data[last], &data[hole], relocate);
 		}
-		else
-			el->next = nullptr;
-		firstFree = el;
+		firstFree = data + end;
+		deferred.clear();
+		storage.Release(end);
 	}
 
-	template<typename Ti, typename SA = DoubleLinkedListSA>
+	template<typename Ti, typename SA = ReorderingSA>
 	class Iterator : public std::iterator<std::forward_iterator_tag, Ti>
 	{
-		// We need to save the next element explicitly to allow deletion during iteration.
-		ListElement *el, *next;
+		SA *array;
+		Ti *el, *firstFree;
 	public:
-		Iterator(SA *array) : el(array ? array->firstUsed : nullptr), next(el ? el->next : nullptr) { }
+		Iterator(SA *array) : array(array), el(array && array->firstFree != array->storage.Data() ? array->storage.Data() : nullptr), firstFree(array ? array->firstFree : nullptr)
+		{
+		}
 
 		Iterator& operator++()
 		{
-			el = next;
-			next = el ? el->next : nullptr;
+			// When el is deleted, the next element is the same element.
+			if (firstFree != array->firstFree)
+				firstFree = array->firstFree;
+			else
+				el++;
+			if (el >= firstFree)
+				el = nullptr;
 			return *this;
 		}
 
 		bool operator==(Iterator other) { return el == other.el; }
 		bool operator!=(Iterator other) { return !(*this == other); }
-		Ti& operator*() const { return el->data; }
+		Ti& operator*() const { return *el; }
 	};
 
 	Iterator<T> begin() { return Iterator<T>(this); }
 	Iterator<T> end() { return Iterator<T>(nullptr); }
-	Iterator<const T, const DoubleLinkedListSA> begin() const { return Iterator<const T, const DoubleLinkedListSA>(this); }
-	Iterator<const T, const DoubleLinkedListSA> end() const { return Iterator<const T, const DoubleLinkedListSA>(nullptr); }
+	Iterator<const T, const ReorderingSA> begin() const { return Iterator<const T, const ReorderingSA>(this); }
+	Iterator<const T, const ReorderingSA> end() const { return Iterator<const T, const ReorderingSA>(nullptr); }
 };
 
-template<typename T, size_t N>
-class ReorderingSA
+// ReorderingSA variant with handles which stay valid when elements move (like a slot map). Each
+// element owns a slot which stores its position in the dense array, and each position stores its
+// slot. Deleting an element increments the generation of its slot, so Get returns nullptr for stale
+// handles.
+template<typename T, size_t N, typename Storage = InlineStorage, typename Index = sa_detail::LinkIndex<N>>
+class HandleReorderingSA
 {
-	T data[N];
-	T *firstFree = data;
+	static_assert(N <= (Index) -1, "Index type too small for N");
+
+public:
+	struct Handle
+	{
+		Index slot;
+		uint32_t generation;
+
+		bool operator==(Handle other) const { return slot == other.slot && generation == other.generation; }
+		bool operator!=(Handle other) const { return !(*this == other); }
+	};
+
+	// Marks the end of the free slot list and invalid handles.
+	static constexpr Index None = (Index) -1;
+
+private:
+	struct Slot
+	{
+		Index position; // of the element or the next free slot
+		uint32_t generation;
+	};
+
+	typename Storage::template Array<T, N> storage;
+	T *firstFree = storage.Data();
+	Slot slots[N];
+	// Slot of the element at each position.
+	Index owners[N];
+	Index freeSlot = None;
+	// Slots starting at firstUntouched have never been used. They implicitly follow the last slot of
+	// the free list.
+	size_t firstUntouched = 0;
+
+	// Assigns a slot to the new element at position pos.
+	void Own(size_t pos)
+	{
+		Index slot = freeSlot;
+		if (slot != None)
+			freeSlot = slots[slot].position;
+		else
+		{
+			slot = firstUntouched++;
+			slots[slot].generation = 0;
+		}
+		slots[slot].position = pos;
+		owners[pos] = slot;
+	}
+
+	// Frees the slot of the element at position pos and moves the last element there.
+	void Remove(size_t pos)
+	{
+		T *data = storage.Data(), *el = data + pos, *lastUsed = --firstFree;
+		Index slot = owners[pos];
+		slots[slot].generation++;
+		slots[slot].position = freeSlot;
+		freeSlot = slot;
+		// The moved element keeps its slot, which has to learn its new position.
+		auto relocate = [this, data](T *from, T *to)
+		{
+			owners[to - data] = owners[from - data];
+			slots[owners[to - data]].position = to - data;
+		};
+		el->~T();
+		if (el != lastUsed)
+			sa_detail::MoveElement(lastUsed, el, relocate);
+	}
+
+	// Parallel passes split the array into tasks of 4096 elements.
+	size_t ParallelTasks() const { return (firstFree - storage.Data() + 4095) / 4096; }
+
+	template<typename Fn>
+	void ForEachInTask(size_t task, Fn fn)
+	{
+		size_t used = firstFree - storage.Data();
+		for (size_t i = task * 4096; i < used && i < task * 4096 + 4096; i++)
+			fn(storage.Data()[i]);
+	}
 
 public:
+	HandleReorderingSA() { }
+
+	~HandleReorderingSA()
+	{
+		for (T *el = storage.Data(); el < firstFree; el++)
+			el->~T();
+	}
+
 	T* New()
 	{
+		return Emplace();
+	}
+
+	// Constructs a new element with the given arguments in an unused spot. Returns nullptr if the
+	// array is full.
+	template<typename... Args>
+	T* Emplace(Args&&... args)
+	{
+		T *data = storage.Data();
 		if (firstFree < data + N)
-			return firstFree++;
+		{
+			storage.Commit(firstFree - data + 1);
+			Own(firstFree - data);
+			return sa_detail::Construct<T>(firstFree++, std::forward<Args>(args)...);
+		}
 		return nullptr;
 	}
 
+	// Claims up to n unused elements and stores pointers to them in out. Returns the number of
+	// claimed elements.
+	size_t New(size_t n, T **out)
+	{
+		T *data = storage.Data();
+		size_t used = firstFree - data;
+		if (n > N - used)
+			n = N - used;
+		storage.Commit(used + n);
+		for (size_t i = 0; i < n; i++)
+		{
+			Own(firstFree - data);
+			out[i] = sa_detail::Construct<T>(firstFree++);
+		}
+		return n;
+	}
+
+	// Returns a handle for el, which stays valid until el is deleted.
+	Handle HandleOf(const T *el) const
+	{
+		assert(el >= storage.Data() && el < firstFree);
+		Index slot = owners[el - storage.Data()];
+		return {slot, slots[slot].generation};
+	}
+
+	// Returns the element of a handle or nullptr if it was deleted. The pointer is only valid until
+	// the next Delete.
+	T* Get(Handle h)
+	{
+		// Own hands out at most N slots. Without telling the compiler, it warns about reading past
+		// slots for constant invalid handles like None.
+		if (firstUntouched > N)
+			__builtin_unreachable();
+		if (h.slot >= firstUntouched || slots[h.slot].generation != h.generation)
+			return nullptr;
+		return storage.Data() + slots[h.slot].position;
+	}
+
+	const T* Get(Handle h) const
+	{
+		return const_cast<HandleReorderingSA*>(this)->Get(h);
+	}
+
 	void Delete(T *el)
 	{
-		assert(el >= data && el < firstFree);
-		auto lastUsed = firstFree - 1;
-		if (el != lastUsed)
-			*el = std::move(*lastUsed);
-		firstFree--;
+		assert(el >= storage.Data() && el < firstFree);
+		Remove(el - storage.Data());
+		storage.Release(firstFree - storage.Data());
 	}
 
-	template<typename Ti, typename SA = ReorderingSA>
+	void Delete(Handle h)
+	{
+		T *el = Get(h);
+		assert(el);
+		Delete(el);
+	}
+
+	// Calls pred for all used elements and deletes the elements for which it returns true. pred must
+	// not add or delete elements itself.
+	template<typename Pred>
+	void RemoveIf(Pred pred)
+	{
+		// Like Delete, this moves the last element into the hole, which is then visited next.
+		for (T *el = storage.Data(); el < firstFree; )
+			if (pred(*el))
+				Remove(el - storage.Data());
+			else
+				el++;
+		storage.Release(firstFree - storage.Data());
+	}
+
+	// Calls fn for all used elements on the threads of pool and deletes the elements for which it
+	// returns true afterwards. fn is called concurrently for different elements and must not add or
+	// delete elements itself.
+	template<typename Fn>
+	void ParallelForEach(Fn fn, ThreadPool& pool)
+	{
+		sa_detail::ParallelPass<T>(pool, ParallelTasks(), [&](size_t task, std::vector<T*>& deleted)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el)) deleted.push_back(&el); });
+		}, [this](T *el) { Delete(el); });
+	}
+
+	// Like ParallelForEach, but the outcome doesn't depend on the number of threads. fn(el, task) may
+	// update task.value and Spawn new elements. Returns the values of all tasks combined in order.
+	template<typename Acc, typename Fn, typename Combine = std::plus<Acc>>
+	Acc DeterministicForEach(Fn fn, ThreadPool& pool, Combine combine = Combine())
+	{
+		return sa_detail::DeterministicPass<T, Acc>(pool, ParallelTasks(), [&](size_t task, DeterministicTask<T, Acc>& state)
+		{
+			ForEachInTask(task, [&](T& el) { if (fn(el, state)) state.deleted.push_back(&el); });
+		}, combine, [this](T *el) { Delete(el); }, [this](const T& el) { Emplace(el); });
+	}
+
+	template<typename Ti, typename SA = HandleReorderingSA>
 	class Iterator : public std::iterator<std::forward_iterator_tag, Ti>
 	{
 		SA *array;
 		Ti *el, *firstFree;
 	public:
-		Iterator(SA *array) : array(array), el(array ? array->data : nullptr), firstFree(array ? array->firstFree : nullptr)
+		Iterator(SA *array) : array(array), el(array && array->firstFree != array->storage.Data() ? array->storage.Data() : nullptr), firstFree(array ? array->firstFree : nullptr)
 		{
 		}
 
@@ -832,6 +3935,9 @@ public:
 
 	Iterator<T> begin() { return Iterator<T>(this); }
 	Iterator<T> end() { return Iterator<T>(nullptr); }
-	Iterator<const T, const ReorderingSA> begin() const { return Iterator<const T, const ReorderingSA>(this); }
-	Iterator<const T, const ReorderingSA> end() const { return Iterator<const T, const ReorderingSA>(nullptr); }
+	Iterator<const T, const HandleReorderingSA> begin() const { return Iterator<const T, const HandleReorderingSA>(this); }
+	Iterator<const T, const HandleReorderingSA> end() const { return Iterator<const T, const HandleReorderingSA>(nullptr); }
 };
+
+template<typename T, size_t N, typename Storage, typename Index>
+constexpr Index HandleReorderingSA<T, N, Storage, Index>::None;
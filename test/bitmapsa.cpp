@@ -1,5 +1,11 @@
 #include "catch.hpp"
 #include "../sparsearray.h"
+#include "counted.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
 
 TEST_CASE("BitmapSA: Basic actions", "[BitmapSA]")
 {
@@ -10,3 +16,475 @@ TEST_CASE("BitmapSA: Basic actions", "[BitmapSA]")
 
 #include "common.h"
 }
+
+TEST_CASE("BitmapSA: Element lifetime", "[BitmapSA]")
+{
+    constexpr int N = 100;
+    BitmapSA<Counted, N> array;
+
+#include "lifetime.h"
+}
+
+TEST_CASE("BitmapSA: Parallel iteration", "[BitmapSA]")
+{
+    // Large enough for several tasks.
+    constexpr int N = 10000;
+    BitmapSA<int, N> array;
+
+#include "parallel.h"
+}
+
+TEST_CASE("BitmapSA: Compaction", "[BitmapSA]")
+{
+    constexpr int N = 100;
+    BitmapSA<Counted, N> array;
+
+#include "compaction.h"
+}
+
+TEST_CASE("BitmapSA: Incremental compaction", "[BitmapSA]")
+{
+    constexpr int N = 300;
+    BitmapSA<Counted, N> array;
+
+#include "incremental.h"
+}
+
+TEST_CASE("BitmapSA (VirtualStorage): Basic actions", "[BitmapSA]")
+{
+    constexpr int N = 100;
+    BitmapSA<int, N, VirtualStorage> array;
+
+#include "common.h"
+}
+
+TEST_CASE("BitmapSA (VirtualStorage): Element lifetime", "[BitmapSA]")
+{
+    constexpr int N = 100;
+    BitmapSA<Counted, N, VirtualStorage> array;
+
+#include "lifetime.h"
+}
+
+TEST_CASE("BitmapSA (VirtualStorage): Committing and releasing", "[BitmapSA]")
+{
+    // Spans several commit granules.
+    constexpr int N = 100000;
+    BitmapSA<int, N, VirtualStorage> array;
+    std::vector<int*> els(N);
+    REQUIRE(array.New(N, els.data()) == N);
+    for (int i = 0; i < N; i++)
+        *els[i] = i;
+
+    // Releasing the tail must not touch the remaining elements.
+    for (int i = N - 1; i >= 1000; i--)
+        array.Delete(els[i]);
+    int i = 0;
+    for (int el : array)
+        REQUIRE(el == i++);
+    REQUIRE(i == 1000);
+
+    for (i = 1000; i < N; i++)
+        *array.New() = i;
+    i = 0;
+    for (int el : array)
+        REQUIRE(el == i++);
+    REQUIRE(i == N);
+}
+
+TEST_CASE("BitmapSA (HugePageSA): Allocation", "[BitmapSA]")
+{
+    // Larger than a huge page.
+    constexpr int N = 1000000;
+    std::unique_ptr<HugePageSA<BitmapSA<int, N>>> array(new HugePageSA<BitmapSA<int, N>>);
+    REQUIRE(reinterpret_cast<uintptr_t>(array.get()) % sa_detail::HugePageSize == 0);
+    for (int i = 0; i < N; i++)
+        *array->New() = i;
+    REQUIRE(array->New() == nullptr);
+    int i = 0;
+    for (int el : *array)
+        REQUIRE(el == i++);
+    REQUIRE(i == N);
+
+    // Small arrays use normal allocation.
+    std::unique_ptr<HugePageSA<BitmapSA<int, 100>>> small(new HugePageSA<BitmapSA<int, 100>>);
+    *small->New() = 1;
+    REQUIRE(*small->begin() == 1);
+}
+
+TEST_CASE("ConcurrentBitmapSA: Basic actions", "[ConcurrentBitmapSA]")
+{
+    constexpr int N = 100;
+    ConcurrentBitmapSA<int, N> array;
+
+#include "common.h"
+}
+
+TEST_CASE("ConcurrentBitmapSA: Element lifetime", "[ConcurrentBitmapSA]")
+{
+    constexpr int N = 100;
+    ConcurrentBitmapSA<Counted, N> array;
+
+#include "lifetime.h"
+}
+
+TEST_CASE("ConcurrentBitmapSA: Parallel iteration", "[ConcurrentBitmapSA]")
+{
+    // Large enough for several tasks.
+    constexpr int N = 10000;
+    ConcurrentBitmapSA<int, N> array;
+
+#include "parallel.h"
+}
+
+TEST_CASE("ConcurrentBitmapSA: Concurrent New and Delete", "[ConcurrentBitmapSA]")
+{
+    constexpr int N = 10000, Threads = 8, PerThread = N / Threads;
+    ConcurrentBitmapSA<int, N> array;
+    // Each thread repeatedly fills its share of the array and deletes every other element. No
+    // element may be handed out twice. Catch assertions aren't thread-safe, so the threads only
+    // count errors.
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < Threads; t++)
+        threads.emplace_back([&array, &errors, t]()
+        {
+            std::vector<int*> els;
+            for (int round = 0; round < 20; round++)
+            {
+                while (els.size() < PerThread)
+                {
+                    int *el = array.New();
+                    if (!el)
+                    {
+                        errors++;
+                        return;
+                    }
+                    *el = t;
+                    els.push_back(el);
+                }
+                for (size_t i = 0; i < els.size(); i++)
+                    if (*els[i] != t)
+                        errors++;
+                std::vector<int*> kept;
+                for (size_t i = 0; i < els.size(); i++)
+                    if (i % 2)
+                        kept.push_back(els[i]);
+                    else
+                        array.Delete(els[i]);
+                els.swap(kept);
+            }
+        });
+    for (auto& thread : threads)
+        thread.join();
+    REQUIRE(errors == 0);
+
+    int count[Threads] = {0}, total = 0;
+    for (int el : array)
+        count[el]++, total++;
+    for (int t = 0; t < Threads; t++)
+        REQUIRE(count[t] == PerThread / 2);
+    REQUIRE(total == N / 2);
+}
+
+TEST_CASE("ConcurrentBitmapSA: Magazine", "[ConcurrentBitmapSA]")
+{
+    constexpr int N = 200;
+    ConcurrentBitmapSA<int, N> array;
+    Magazine<ConcurrentBitmapSA<int, N>, 64> magazine(array);
+
+    SECTION("should hand out elements in memory order")
+    {
+        for (int i = 0; i < 10; i++)
+            *magazine.New() = i;
+        magazine.Flush();
+        int i = 0;
+        for (int el : array)
+            REQUIRE(el == i++);
+        REQUIRE(i == 10);
+        // The unused elements are free again.
+        REQUIRE(array.New() == &*array.begin() + 10);
+    }
+
+    SECTION("should leave claimed elements in the array until flushed")
+    {
+        *magazine.New() = 1;
+        // The other claimed elements are default-initialized placeholders.
+        REQUIRE(*array.begin() == 1);
+        REQUIRE(std::distance(array.begin(), array.end()) == 64);
+        magazine.Flush();
+        REQUIRE(*array.begin() == 1);
+        REQUIRE(std::distance(array.begin(), array.end()) == 1);
+    }
+
+    SECTION("should refill until the array is full")
+    {
+        for (int i = 0; i < N; i++)
+        {
+            int *el = magazine.New();
+            REQUIRE(el != nullptr);
+            *el = i;
+        }
+        REQUIRE(magazine.New() == nullptr);
+        int i = 0;
+        for (int el : array)
+            REQUIRE(el == i++);
+        REQUIRE(i == N);
+    }
+
+    SECTION("should delete through the array")
+    {
+        int *els[10];
+        for (auto& el : els)
+            el = magazine.Emplace(1);
+        for (auto el : els)
+            magazine.Delete(el);
+        magazine.Flush();
+        REQUIRE(array.begin() == array.end());
+    }
+}
+
+TEST_CASE("ConcurrentBitmapSA: Concurrent magazines", "[ConcurrentBitmapSA]")
+{
+    // Leave enough space for the elements the magazines hold back.
+    constexpr int N = 10000, Threads = 8, PerThread = N / Threads / 2;
+    ConcurrentBitmapSA<int, N> array;
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < Threads; t++)
+        threads.emplace_back([&array, &errors, t]()
+        {
+            Magazine<ConcurrentBitmapSA<int, N>> magazine(array);
+            std::vector<int*> els;
+            for (int round = 0; round < 20; round++)
+            {
+                while (els.size() < PerThread)
+                {
+                    int *el = magazine.New();
+                    if (!el)
+                    {
+                        errors++;
+                        return;
+                    }
+                    *el = t;
+                    els.push_back(el);
+                }
+                for (size_t i = 0; i < els.size(); i++)
+                    if (*els[i] != t)
+                        errors++;
+                std::vector<int*> kept;
+                for (size_t i = 0; i < els.size(); i++)
+                    if (i % 2)
+                        kept.push_back(els[i]);
+                    else
+                        magazine.Delete(els[i]);
+                els.swap(kept);
+            }
+        });
+    for (auto& thread : threads)
+        thread.join();
+    REQUIRE(errors == 0);
+
+    int count[Threads] = {0}, total = 0;
+    for (int el : array)
+        count[el]++, total++;
+    for (int t = 0; t < Threads; t++)
+        REQUIRE(count[t] == PerThread / 2);
+    REQUIRE(total == Threads * (PerThread / 2));
+}
+
+TEST_CASE("HierarchicalBitmapSA: Basic actions", "[HierarchicalBitmapSA]")
+{
+    // We need more than 64*64 elements to verify calculations with
+    // multiple summary elements.
+    constexpr int N = 4200;
+    HierarchicalBitmapSA<int, N> array;
+
+#include "common.h"
+}
+
+TEST_CASE("HierarchicalBitmapSA: Element lifetime", "[HierarchicalBitmapSA]")
+{
+    constexpr int N = 4200;
+    HierarchicalBitmapSA<Counted, N> array;
+
+#include "lifetime.h"
+}
+
+TEST_CASE("HierarchicalBitmapSA: Parallel iteration", "[HierarchicalBitmapSA]")
+{
+    // Large enough for several tasks.
+    constexpr int N = 10000;
+    HierarchicalBitmapSA<int, N> array;
+
+#include "parallel.h"
+}
+
+TEST_CASE("HierarchicalBitmapSA: Several top-level words", "[HierarchicalBitmapSA]")
+{
+    // Each top-level word covers 64 * 64 * 64 elements.
+    constexpr size_t Top = 64 * 64 * 64, N = 3 * Top + 1000;
+    std::unique_ptr<HierarchicalBitmapSA<int, N>> array(new HierarchicalBitmapSA<int, N>);
+    std::vector<int*> els(N);
+    REQUIRE(array->New(N, els.data()) == N);
+    for (size_t i = 0; i < N; i++)
+        *els[i] = i;
+
+    SECTION("New should find single holes")
+    {
+        for (size_t i : {2 * Top + 5, Top + 7, N - 1})
+        {
+            array->Delete(els[i]);
+            REQUIRE(array->New() == els[i]);
+        }
+        REQUIRE(array->New() == nullptr);
+    }
+
+    SECTION("iteration should skip empty top-level words")
+    {
+        array->RemoveIf([&](int el) { return el != 3 && el != (int) (2 * Top + 9) && el != (int) N - 1; });
+        std::vector<int> left(array->begin(), array->end());
+        REQUIRE(left == (std::vector<int>{3, (int) (2 * Top + 9), (int) N - 1}));
+
+        array->Delete(els[N - 1]);
+        array->Delete(els[2 * Top + 9]);
+        left.assign(array->begin(), array->end());
+        REQUIRE(left == std::vector<int>{3});
+        REQUIRE(array->New() == els[0]);
+    }
+}
+
+TEST_CASE("GrowableBitmapSA: Basic actions", "[GrowableBitmapSA]")
+{
+    // Segments of 100 elements use multiple mask words, the size limit makes the array full after
+    // three segments.
+    constexpr int N = 300;
+    GrowableBitmapSA<int, 100> array(N / 100);
+
+#include "common.h"
+}
+
+TEST_CASE("GrowableBitmapSA: Element lifetime", "[GrowableBitmapSA]")
+{
+    constexpr int N = 300;
+    GrowableBitmapSA<Counted, 100> array;
+
+#include "lifetime.h"
+}
+
+TEST_CASE("GrowableBitmapSA: Parallel iteration", "[GrowableBitmapSA]")
+{
+    // Large enough for several tasks.
+    constexpr int N = 10000;
+    GrowableBitmapSA<int, 1000> array(N / 1000);
+
+#include "parallel.h"
+}
+
+TEST_CASE("GrowableBitmapSA: Default segment size", "[GrowableBitmapSA]")
+{
+    // The default segments fill a 64 KiB block, but one more element wouldn't fit.
+    using Array = GrowableBitmapSA<int>;
+    constexpr size_t n = Array::SegmentElements;
+    REQUIRE(Array::SegmentBlock == 65536);
+    REQUIRE(sa_detail::BlockBytes(sa_detail::SegmentHeaderBytes, n, sizeof(int), alignof(int)) + sa_detail::AllocatorSlack <= 65536);
+    REQUIRE(sa_detail::BlockBytes(sa_detail::SegmentHeaderBytes, n + 1, sizeof(int), alignof(int)) + sa_detail::AllocatorSlack > 65536);
+
+    // A single segment holds exactly n elements.
+    Array array(1);
+    for (size_t i = 0; i < n; i++)
+        REQUIRE(array.New() != nullptr);
+    REQUIRE(array.New() == nullptr);
+
+    // Elements larger than the block get a segment each.
+    struct Large { char c[70000]; };
+    REQUIRE(GrowableBitmapSA<Large>::SegmentElements == 1);
+}
+
+TEST_CASE("GrowableBitmapSA: Growing and shrinking", "[GrowableBitmapSA]")
+{
+    GrowableBitmapSA<int, 64> array;
+    std::vector<int*> els;
+    for (int i = 0; i < 1000; i++)
+    {
+        els.push_back(array.New());
+        *els.back() = i;
+    }
+
+    SECTION("elements should not move while growing")
+    {
+        for (int i = 0; i < 1000; i++)
+            REQUIRE(*els[i] == i);
+        int i = 0;
+        for (int el : array)
+            REQUIRE(el == i++);
+        REQUIRE(i == 1000);
+    }
+
+    SECTION("the array should shrink and grow again")
+    {
+        for (int i = 999; i >= 10; i--)
+            array.Delete(els[i]);
+        array.Trim();
+        int i = 0;
+        for (int el : array)
+            REQUIRE(el == i++);
+        REQUIRE(i == 10);
+
+        int *more[500];
+        REQUIRE(array.New(500, more) == 500);
+        REQUIRE(more[0] == els[10]);
+        for (int *el : more)
+            *el = i++;
+        i = 0;
+        for (int el : array)
+            REQUIRE(el == i++);
+        REQUIRE(i == 510);
+    }
+
+    SECTION("deleting during iteration should release segments safely")
+    {
+        for (int& el : array)
+            if (el >= 64)
+                array.Delete(&el);
+        int i = 0;
+        for (int el : array)
+            REQUIRE(el == i++);
+        REQUIRE(i == 64);
+    }
+}
+
+TEST_CASE("BitmapSA: Word scanning", "[BitmapSA]")
+{
+    std::vector<std::pair<const char*, sa_detail::FindWordNotEqualFn>> impls = {
+        {"scalar", sa_detail::FindWordNotEqualScalar},
+    };
+#ifdef SA_X86_DISPATCH
+    if (__builtin_cpu_supports("avx2"))
+        impls.push_back({"avx2", sa_detail::FindWordNotEqualAVX2});
+    if (__builtin_cpu_supports("avx512f"))
+        impls.push_back({"avx512", sa_detail::FindWordNotEqualAVX512});
+#endif
+
+    constexpr size_t len = 40;
+    const uint64_t full = ~(uint64_t) 0;
+    uint64_t words[len];
+    for (auto impl : impls)
+    {
+        CAPTURE(impl.first);
+        // Place a single differing word at every position for every start offset.
+        for (size_t begin = 0; begin < len; begin++)
+            for (size_t pos = 0; pos <= len; pos++)
+            {
+                CAPTURE(begin);
+                CAPTURE(pos);
+                for (size_t i = 0; i < len; i++)
+                    words[i] = i == pos ? 0x10 : full;
+                size_t expected = pos >= begin && pos < len ? pos : len;
+                REQUIRE(impl.second(words, begin, len, full) == expected);
+                for (size_t i = 0; i < len; i++)
+                    words[i] = i == pos ? full : 0;
+                REQUIRE(impl.second(words, begin, len, 0) == expected);
+            }
+    }
+}
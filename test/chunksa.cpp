@@ -1,5 +1,6 @@
 #include "catch.hpp"
 #include "../sparsearray.h"
+#include "counted.h"
 
 TEST_CASE("ChunkSA: Basic actions", "[ChunkSA]")
 {
@@ -9,6 +10,67 @@ TEST_CASE("ChunkSA: Basic actions", "[ChunkSA]")
 #include "common.h"
 }
 
+TEST_CASE("ChunkSA: Element lifetime", "[ChunkSA]")
+{
+    constexpr int N = 10;
+    ChunkSA<Counted, N, 2> array;
+
+#include "lifetime.h"
+}
+
+TEST_CASE("ChunkSA: Parallel iteration", "[ChunkSA]")
+{
+    // Large enough for several tasks.
+    constexpr int N = 10000;
+    ChunkSA<int, N> array;
+
+#include "parallel.h"
+}
+
+TEST_CASE("ChunkSA: Compaction", "[ChunkSA]")
+{
+    // Several chunks, so elements move between them and chunks are retired.
+    constexpr int N = 100;
+    ChunkSA<Counted, N, 10> array;
+
+#include "compaction.h"
+}
+
+TEST_CASE("ChunkSA: Incremental compaction", "[ChunkSA]")
+{
+    // Several chunks with two occupancy words each.
+    constexpr int N = 300;
+    ChunkSA<Counted, N, 100> array;
+
+#include "incremental.h"
+}
+
+TEST_CASE("ChunkSA: Basic actions with multi-word chunks", "[ChunkSA]")
+{
+    constexpr int N = 300;
+    ChunkSA<int, N, 100> array;
+
+#include "common.h"
+}
+
+TEST_CASE("Bitmap: Forward search", "[ChunkSA]")
+{
+    constexpr size_t N = 200;
+    sa_detail::Bitmap<N> bitmap;
+    const size_t npos = bitmap.npos;
+
+    REQUIRE(bitmap.FindNextSet(0) == npos);
+    REQUIRE(bitmap.FindNextSet(N) == npos);
+
+    bitmap.set(3); bitmap.set(64); bitmap.set(130); bitmap.set(N - 1);
+    for (size_t i = 0; i <= N; i++)
+    {
+        CAPTURE(i);
+        size_t expected = i <= 3 ? 3 : i <= 64 ? 64 : i <= 130 ? 130 : i < N ? N - 1 : npos;
+        REQUIRE(bitmap.FindNextSet(i) == expected);
+    }
+}
+
 TEST_CASE("StaticChunkSA: Basic actions", "[StaticChunkSA]")
 {
     constexpr int N = 10;
@@ -16,3 +78,85 @@ TEST_CASE("StaticChunkSA: Basic actions", "[StaticChunkSA]")
 
 #include "common.h"
 }
+
+TEST_CASE("StaticChunkSA: Element lifetime", "[StaticChunkSA]")
+{
+    constexpr int N = 10;
+    StaticChunkSA<Counted, N, 2> array;
+
+#include "lifetime.h"
+}
+
+TEST_CASE("StaticChunkSA: Parallel iteration", "[StaticChunkSA]")
+{
+    // Large enough for several tasks.
+    constexpr int N = 10000;
+    StaticChunkSA<int, N> array;
+
+#include "parallel.h"
+}
+
+TEST_CASE("StaticChunkSA: Compaction", "[StaticChunkSA]")
+{
+    // Several chunks, so elements move between them.
+    constexpr int N = 100;
+    StaticChunkSA<Counted, N, 10> array;
+
+#include "compaction.h"
+}
+
+TEST_CASE("StaticChunkSA: Incremental compaction", "[StaticChunkSA]")
+{
+    // Several chunks, so elements move between them.
+    constexpr int N = 300;
+    StaticChunkSA<Counted, N, 10> array;
+
+#include "incremental.h"
+}
+
+TEST_CASE("StaticChunkSA: Basic actions with multi-word chunks", "[StaticChunkSA]")
+{
+    constexpr int N = 300;
+    StaticChunkSA<int, N, 100> array;
+
+#include "common.h"
+}
+
+TEST_CASE("ChunkSA: Default chunk size", "[ChunkSA]")
+{
+    // 400 elements of 20 byte with their header fill an 8 KiB block.
+    struct Twenty { int32_t v[5]; };
+    REQUIRE((ChunkSA<Twenty, 10000>::ChunkElements == 400));
+    REQUIRE(sa_detail::BlockBytes(sizeof(size_t), 400, sizeof(Twenty), alignof(Twenty)) + sa_detail::AllocatorSlack <= 8192);
+    // Without a divisor between 256 and 4096, there is a single chunk.
+    REQUIRE((ChunkSA<Twenty, 10>::ChunkElements == 10));
+    REQUIRE((ChunkSA<Twenty, 10007>::ChunkElements == 10007));
+}
+
+TEST_CASE("ChunkSA: Chunk pool", "[ChunkSA]")
+{
+    ChunkSA<int, 10, 2, 2, 1> array;
+    int *a = array.New(), *b = array.New(), *c = array.New();
+
+    SECTION("empty chunks should be reused")
+    {
+        array.Delete(c);
+        int *d = array.New();
+        REQUIRE(d == c);
+    }
+
+    SECTION("the pool should work after trimming")
+    {
+        array.Delete(c);
+        array.Trim();
+        int *d = array.New(), *e = array.New();
+        REQUIRE(d != nullptr);
+        REQUIRE(e == d + 1);
+    }
+
+    array.Delete(a);
+    array.Delete(b);
+    for (int& el : array)
+        array.Delete(&el);
+    REQUIRE(array.begin() == array.end());
+}
@@ -6,6 +6,19 @@ SECTION("should be initially empty")
 	REQUIRE(array.begin() == array.end());
 }
 
+SECTION("batch filling should work")
+{
+	int *els[N + 1];
+	REQUIRE(array.New(N + 1, els) == N);
+	for (int i = 0; i < N; i++)
+		*els[i] = i;
+	int i = 0;
+	for (int el : array)
+		CHECK(el == i++);
+	REQUIRE(i == N);
+	REQUIRE(array.New(1, els) == 0);
+}
+
 SECTION("filling should work")
 {
 	for (int i = 0; i < N; i++)
@@ -36,6 +49,26 @@ SECTION("filling should work")
 		REQUIRE(array.begin() == array.end());
 	}
 
+	SECTION("after deleting everything from the back, insertion should start at the front")
+	{
+		for (int i = N - 1; i >= 0; i--)
+		{
+			int j = 0;
+			for (int& el : array)
+				if (j++ == i)
+					array.Delete(&el);
+		}
+		REQUIRE(array.begin() == array.end());
+		for (int i = 0; i < N; i++)
+		{
+			*array.New() = i;
+		}
+		int i = 0;
+		for (int el : array)
+			CHECK(el == i++);
+		REQUIRE(i == N);
+	}
+
 	SECTION("after deletion, insertion should fill the spots")
 	{
 		int i = 0;
@@ -57,4 +90,50 @@ SECTION("filling should work")
 			REQUIRE(i <= N);
 		}
 	}
+
+	SECTION("RemoveIf should delete matching elements")
+	{
+		int i = 0;
+		array.RemoveIf([&i](int& el) { CHECK(el == i++); return el % 2 == 1; });
+		REQUIRE(i == N);
+		i = 0;
+		for (int el : array)
+		{
+			CHECK(el == i);
+			i += 2;
+			REQUIRE(i <= N + 1);
+		}
+		for (i = 1; i < N; i += 2)
+		{
+			*array.New() = i;
+		}
+		i = 0;
+		for (int el : array)
+		{
+			CHECK(el == i++);
+			REQUIRE(i <= N);
+		}
+	}
+
+	SECTION("after deletion, batch insertion should fill the spots")
+	{
+		int i = 0;
+		for (int& el : array)
+		{
+			if (i++ % 2 == 0)
+			{
+				array.Delete(&el);
+			}
+		}
+		int *els[N];
+		REQUIRE(array.New(N, els) == (N + 1) / 2);
+		for (i = 0; i < (N + 1) / 2; i++)
+			*els[i] = 2 * i;
+		i = 0;
+		for (int el : array)
+		{
+			CHECK(el == i++);
+			REQUIRE(i <= N);
+		}
+	}
 }
@@ -0,0 +1,81 @@
+/* Common compaction tests for the SA implementations which leave holes. */
+
+REQUIRE(Counted::Live() == 0);
+
+SECTION("compacting an empty array should do nothing")
+{
+	REQUIRE(array.Fragmentation() == 0);
+	REQUIRE(array.Compact() == 0);
+	REQUIRE(array.begin() == array.end());
+}
+
+SECTION("Fragmentation should count holes before the last element")
+{
+	for (int i = 0; i < N; i++)
+		array.Emplace(i);
+	REQUIRE(array.Fragmentation() == 0);
+	array.Delete(&*array.begin());
+	REQUIRE(array.Fragmentation() == Approx(1.0 / N));
+	array.RemoveIf([](Counted& el) { return el.value >= N / 2; });
+	REQUIRE(array.Fragmentation() == Approx(2.0 / N));
+}
+
+SECTION("Compact should close holes and keep the order")
+{
+	for (int i = 0; i < N; i++)
+		array.Emplace(i);
+	array.RemoveIf([](Counted& el) { return el.value % 3 != 0; });
+	const int live = (N + 2) / 3;
+	REQUIRE(array.Fragmentation() > 0.5);
+
+	int reported = 0;
+	size_t moved = array.Compact([&](Counted *from, Counted *to)
+	{
+		CHECK(from != to);
+		CHECK(to->value % 3 == 0);
+		reported++;
+	});
+	REQUIRE(moved == (size_t) live - 1);
+	REQUIRE(reported == live - 1);
+	REQUIRE(Counted::Live() == live);
+	REQUIRE(array.Fragmentation() == 0);
+
+	int i = 0;
+	for (Counted& el : array)
+		CHECK(el.value == 3 * i++);
+	REQUIRE(i == live);
+
+	SECTION("Compact should do nothing the second time")
+	{
+		REQUIRE(array.Compact() == 0);
+	}
+
+	SECTION("new elements should go after the compacted ones")
+	{
+		for (int j = live; j < N; j++)
+			REQUIRE(array.Emplace(-j) != nullptr);
+		REQUIRE(array.New() == nullptr);
+		int j = 0;
+		for (Counted& el : array)
+		{
+			if (j < live)
+				CHECK(el.value == 3 * j);
+			else
+				CHECK(el.value == -j);
+			j++;
+		}
+		REQUIRE(j == N);
+		REQUIRE(array.Fragmentation() == 0);
+	}
+
+	SECTION("Delete should work after compaction")
+	{
+		for (Counted& el : array)
+			if (el.value % 2)
+				array.Delete(&el);
+		REQUIRE(Counted::Live() == live / 2);
+		array.RemoveIf([](Counted&) { return true; });
+		REQUIRE(Counted::Live() == 0);
+		REQUIRE(array.begin() == array.end());
+	}
+}
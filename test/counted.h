@@ -0,0 +1,15 @@
+#pragma once
+
+// Element type which keeps track of how many instances are alive.
+struct Counted
+{
+	static int& Live() { static int live = 0; return live; }
+
+	int value;
+
+	Counted() : value(-1) { Live()++; }
+	Counted(int value) : value(value) { Live()++; }
+	Counted(const Counted& other) : value(other.value) { Live()++; }
+	Counted& operator=(const Counted& other) = default;
+	~Counted() { Live()--; }
+};
@@ -1,5 +1,6 @@
 #include "catch.hpp"
 #include "../sparsearray.h"
+#include "counted.h"
 
 TEST_CASE("DoubleLinkedListSA: Basic actions", "[DoubleLinkedListSA]")
 {
@@ -9,6 +10,47 @@ TEST_CASE("DoubleLinkedListSA: Basic actions", "[DoubleLinkedListSA]")
 #include "common.h"
 }
 
+TEST_CASE("DoubleLinkedListSA: Element lifetime", "[DoubleLinkedListSA]")
+{
+    constexpr int N = 10;
+    DoubleLinkedListSA<Counted, N> array;
+
+#include "lifetime.h"
+}
+
+TEST_CASE("DoubleLinkedListSA: Parallel iteration", "[DoubleLinkedListSA]")
+{
+    // Large enough for several tasks.
+    constexpr int N = 10000;
+    DoubleLinkedListSA<int, N> array;
+
+#include "parallel.h"
+}
+
+TEST_CASE("DoubleLinkedListSA: Compaction", "[DoubleLinkedListSA]")
+{
+    constexpr int N = 100;
+    DoubleLinkedListSA<Counted, N> array;
+
+#include "compaction.h"
+}
+
+TEST_CASE("DoubleLinkedListSA (SplitLayout): Basic actions", "[DoubleLinkedListSA]")
+{
+    constexpr int N = 10;
+    DoubleLinkedListSA<int, N, SplitLayout> array;
+
+#include "common.h"
+}
+
+TEST_CASE("DoubleLinkedListSA (SplitLayout): Element lifetime", "[DoubleLinkedListSA]")
+{
+    constexpr int N = 10;
+    DoubleLinkedListSA<Counted, N, SplitLayout> array;
+
+#include "lifetime.h"
+}
+
 typedef DoubleLinkedListSA<int, 3> LinkedListSAIntThree;
 
 TEST_CASE_METHOD(LinkedListSAIntThree, "DoubleLinkedListSA: Internals", "[DoubleLinkedListSA]")
@@ -18,27 +60,27 @@ TEST_CASE_METHOD(LinkedListSAIntThree, "DoubleLinkedListSA: Internals", "[Double
 
     SECTION("New should set pointers correctly")
     {
-        REQUIRE(&firstUsed->data == one);
-        REQUIRE(firstFree == nullptr);
+        REQUIRE(&Data(firstUsed) == one);
+        REQUIRE(firstFree == None);
     }
 
     SECTION("Delete should set pointers correctly")
     {
         Delete(two);
-        REQUIRE(&firstFree->data == two);
-        REQUIRE(firstFree->next == nullptr);
-        REQUIRE(firstUsed->next->data == 3);
-        REQUIRE(firstUsed->next->prev->data == 1);
+        REQUIRE(&Data(firstFree) == two);
+        REQUIRE(Next(firstFree) == None);
+        REQUIRE(Data(Next(firstUsed)) == 3);
+        REQUIRE(Data(Prev(Next(firstUsed))) == 1);
     }
 
     SECTION("out-of-order deletion should set pointers correctly")
     {
         Delete(two); Delete(three); Delete(one);
-        REQUIRE(firstUsed == nullptr);
-        REQUIRE(firstFree->data == 1);
-        REQUIRE(firstFree->next->data == 2);
-        REQUIRE(firstFree->next->next->data == 3);
-        REQUIRE(firstFree->next->next->next == nullptr);
+        REQUIRE(firstUsed == None);
+        REQUIRE(Data(firstFree) == 1);
+        REQUIRE(Data(Next(firstFree)) == 2);
+        REQUIRE(Data(Next(Next(firstFree))) == 3);
+        REQUIRE(Next(Next(Next(firstFree))) == None);
     }
 
     SECTION("insertion should keep order and set prev-pointers correctly")
@@ -48,9 +90,22 @@ TEST_CASE_METHOD(LinkedListSAIntThree, "DoubleLinkedListSA: Internals", "[Double
         REQUIRE(*New() == 3);
         Delete(two);
         REQUIRE(*New() == 2);
-        REQUIRE(firstUsed->data == 1);
-        REQUIRE(firstUsed->next->prev->data == 1);
-        REQUIRE(firstUsed->next->next->prev->data == 2);
+        REQUIRE(Data(firstUsed) == 1);
+        REQUIRE(Data(Prev(Next(firstUsed))) == 1);
+        REQUIRE(Data(Prev(Next(Next(firstUsed)))) == 2);
+    }
+
+    SECTION("batch insertion should keep order and set prev-pointers correctly")
+    {
+        Delete(one); Delete(three);
+        int *els[3];
+        REQUIRE(New(3, els) == 2);
+        REQUIRE(els[0] == one);
+        REQUIRE(els[1] == three);
+        REQUIRE(Prev(firstUsed) == None);
+        REQUIRE(Data(Prev(Next(firstUsed))) == 1);
+        REQUIRE(Data(Prev(Next(Next(firstUsed)))) == 2);
+        REQUIRE(Next(Next(Next(firstUsed))) == None);
     }
 
 }
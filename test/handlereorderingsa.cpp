@@ -0,0 +1,103 @@
+#include "catch.hpp"
+#include "../sparsearray.h"
+#include "counted.h"
+
+#include <vector>
+
+TEST_CASE("HandleReorderingSA: Element lifetime", "[HandleReorderingSA]")
+{
+    constexpr int N = 10;
+    HandleReorderingSA<Counted, N> array;
+
+#include "lifetime.h"
+}
+
+TEST_CASE("HandleReorderingSA: Parallel iteration", "[HandleReorderingSA]")
+{
+    // Large enough for several tasks.
+    constexpr int N = 10000;
+    HandleReorderingSA<int, N> array;
+
+#include "parallel.h"
+}
+
+TEST_CASE("HandleReorderingSA: Handles", "[HandleReorderingSA]")
+{
+    constexpr int N = 100;
+    typedef HandleReorderingSA<int, N> SA;
+    SA array;
+    std::vector<SA::Handle> handles;
+    for (int i = 0; i < N; i++)
+    {
+        int *el = array.New();
+        REQUIRE(el != nullptr);
+        *el = i;
+        handles.push_back(array.HandleOf(el));
+    }
+    REQUIRE(array.New() == nullptr);
+
+    SECTION("handles should find their elements")
+    {
+        for (int i = 0; i < N; i++)
+            REQUIRE(*array.Get(handles[i]) == i);
+        SA::Handle none = {SA::None, 0};
+        REQUIRE(array.Get(none) == nullptr);
+    }
+
+    SECTION("handles should survive moving elements")
+    {
+        // Deleting from the front moves the last elements forward.
+        for (int i = 0; i < N / 2; i++)
+            array.Delete(handles[i]);
+        for (int i = 0; i < N / 2; i++)
+            REQUIRE(array.Get(handles[i]) == nullptr);
+        for (int i = N / 2; i < N; i++)
+            REQUIRE(*array.Get(handles[i]) == i);
+        int count = 0;
+        for (int& el : array)
+        {
+            REQUIRE(array.HandleOf(&el) == handles[el]);
+            count++;
+        }
+        REQUIRE(count == N / 2);
+    }
+
+    SECTION("stale handles should not find reused slots")
+    {
+        array.Delete(array.Get(handles[3]));
+        int *el = array.New();
+        *el = 1000;
+        SA::Handle h = array.HandleOf(el);
+        REQUIRE(h.slot == handles[3].slot);
+        REQUIRE(h != handles[3]);
+        REQUIRE(array.Get(handles[3]) == nullptr);
+        REQUIRE(*array.Get(h) == 1000);
+    }
+
+    SECTION("RemoveIf should keep handles valid")
+    {
+        array.RemoveIf([](int el) { return el % 3 == 0; });
+        for (int i = 0; i < N; i++)
+        {
+            CAPTURE(i);
+            if (i % 3 == 0)
+                REQUIRE(array.Get(handles[i]) == nullptr);
+            else
+                REQUIRE(*array.Get(handles[i]) == i);
+        }
+    }
+
+    SECTION("deleting while iterating should visit every element")
+    {
+        int visited = 0;
+        for (int& el : array)
+        {
+            visited++;
+            if (el % 2)
+                array.Delete(&el);
+        }
+        REQUIRE(visited == N);
+        for (int i = 0; i < N; i++)
+            REQUIRE((array.Get(handles[i]) != nullptr) == (i % 2 == 0));
+    }
+}
@@ -0,0 +1,92 @@
+/* Common incremental compaction tests for the SA implementations which support CompactStep. */
+
+REQUIRE(Counted::Live() == 0);
+
+for (int i = 0; i < N; i++)
+	array.Emplace(i);
+array.RemoveIf([](Counted& el) { return el.value % 3 != 0; });
+const int live = (N + 2) / 3;
+
+// Checks that the surviving values are still in order and that nothing was lost.
+auto checkOrder = [&]()
+{
+	int count = 0, last = -1;
+	for (Counted& el : array)
+	{
+		if (el.value >= 0)
+		{
+			CHECK(el.value > last);
+			last = el.value;
+		}
+		count++;
+	}
+	CHECK(count == Counted::Live());
+	return count;
+};
+
+SECTION("CompactStep should move a limited number of elements per call")
+{
+	int reported = 0, calls = 0;
+	size_t moved;
+	do
+	{
+		moved = array.CompactStep(5, [&](Counted *, Counted *to)
+		{
+			CHECK(to->value % 3 == 0);
+			reported++;
+		});
+		REQUIRE(moved <= 5);
+		REQUIRE(checkOrder() == live);
+		calls++;
+	}
+	while (moved == 5);
+	REQUIRE(reported == live - 1);
+	REQUIRE(calls == (live - 1) / 5 + 1);
+	REQUIRE(array.Fragmentation() == 0);
+	REQUIRE(array.CompactStep(5) == 0);
+
+	int i = 0;
+	for (Counted& el : array)
+		CHECK(el.value == 3 * i++);
+}
+
+SECTION("CompactStep should restart after deletions before its position")
+{
+	REQUIRE(array.CompactStep(10) == 10);
+	// Leave a hole at the front, which is behind the cursor.
+	array.Delete(&*array.begin());
+	REQUIRE(array.CompactStep(3) == 3);
+	array.RemoveIf([](Counted& el) { return el.value == 9; });
+	while (array.CompactStep(3))
+		checkOrder();
+	REQUIRE(checkOrder() == live - 2);
+	REQUIRE(array.Fragmentation() == 0);
+}
+
+SECTION("CompactStep should cope with new elements between calls")
+{
+	REQUIRE(array.CompactStep(10) == 10);
+	array.Emplace(-1);
+	array.Emplace(-2);
+	REQUIRE(array.CompactStep(3) == 3);
+	Counted *els[5];
+	REQUIRE(array.New(5, els) == 5);
+	while (array.CompactStep(3))
+		checkOrder();
+	REQUIRE(checkOrder() == live + 7);
+	REQUIRE(array.Fragmentation() == 0);
+}
+
+SECTION("CompactFor should stop when the array is compact")
+{
+	REQUIRE(array.CompactFor(std::chrono::seconds(10)) == (size_t) live - 1);
+	REQUIRE(array.Fragmentation() == 0);
+	REQUIRE(array.CompactFor(std::chrono::seconds(10)) == 0);
+}
+
+SECTION("CompactFor should stop when the budget is used up")
+{
+	size_t moved = array.CompactFor(std::chrono::microseconds(0));
+	REQUIRE(moved > 0);
+	REQUIRE(moved <= 64);
+}
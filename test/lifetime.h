@@ -0,0 +1,38 @@
+/* Common element lifetime tests for all SA implementations. */
+
+typedef decltype(array) SA;
+REQUIRE(Counted::Live() == 0);
+
+SECTION("New and Emplace should construct elements")
+{
+	REQUIRE(array.New()->value == -1);
+	REQUIRE(array.Emplace(42)->value == 42);
+	Counted *els[2];
+	REQUIRE(array.New(2, els) == 2);
+	REQUIRE(els[0]->value == -1);
+	REQUIRE(Counted::Live() == 4);
+}
+
+SECTION("Delete should destroy elements")
+{
+	for (int i = 0; i < N; i++)
+		array.Emplace(i);
+	REQUIRE(Counted::Live() == N);
+	for (Counted& el : array)
+		if (el.value % 2)
+			array.Delete(&el);
+	REQUIRE(Counted::Live() == (N + 1) / 2);
+	array.RemoveIf([](Counted&) { return true; });
+	REQUIRE(Counted::Live() == 0);
+}
+
+SECTION("destruction should destroy remaining elements")
+{
+	{
+		SA other;
+		other.Emplace(1);
+		other.Emplace(2);
+		REQUIRE(Counted::Live() == 2);
+	}
+	REQUIRE(Counted::Live() == 0);
+}
@@ -1,51 +1,30 @@
 #include "catch.hpp"
 #include "../sparsearray.h"
 
-TEST_CASE("LinkedListBitmapSA: Basic actions", "[LinkedListBitmapSA]")
+TEST_CASE("Bitmap: Backwards search", "[LinkedListBitmapSA]")
 {
-    constexpr int N = 10;
-    LinkedListBitmapSA<int, N> array;
+    constexpr size_t N = 200;
+    sa_detail::Bitmap<N> bitmap;
+    const size_t npos = bitmap.npos;
 
-#include "common.h"
-}
-
-typedef LinkedListBitmapSA<int, 3> LinkedListSAIntThree;
-
-TEST_CASE_METHOD(LinkedListSAIntThree, "LinkedListBitmapSA: Internals", "[LinkedListBitmapSA]")
-{
-    int *one = New(), *two = New(), *three = New();
-    *one = 1; *two = 2; *three = 3;
-
-    SECTION("New should set pointers correctly")
-    {
-        REQUIRE(&firstUsed->data == one);
-        REQUIRE(firstFree == nullptr);
-    }
-
-    SECTION("Delete should set pointers correctly")
-    {
-        Delete(two);
-        REQUIRE(&firstFree->data == two);
-        REQUIRE(firstFree->next == nullptr);
-        REQUIRE(&firstUsed->next->data == three);
-    }
-
-    SECTION("out-of-order deletion should set pointers correctly")
-    {
-        Delete(two); Delete(three); Delete(one);
-        REQUIRE(firstUsed == nullptr);
-        REQUIRE(firstFree->data == 1);
-        REQUIRE(firstFree->next->data == 2);
-        REQUIRE(firstFree->next->next->data == 3);
-        REQUIRE(firstFree->next->next->next == nullptr);
-    }
+    REQUIRE(bitmap.FindPrevSet(N) == npos);
+    REQUIRE(bitmap.FindPrevUnset(N) == N - 1);
+    REQUIRE(bitmap.FindPrevUnset(0) == npos);
 
-    SECTION("insertion should keep order")
+    bitmap.set(3); bitmap.set(64); bitmap.set(130);
+    for (size_t i = 0; i <= N; i++)
     {
-        Delete(three); Delete(one);
-        REQUIRE(*New() == 1);
-        REQUIRE(*New() == 3);
-        REQUIRE(firstUsed->data == 1);
+        CAPTURE(i);
+        size_t expected = i > 130 ? 130 : i > 64 ? 64 : i > 3 ? 3 : npos;
+        REQUIRE(bitmap.FindPrevSet(i) == expected);
     }
 
+    for (size_t i = 0; i < 128; i++)
+        bitmap.set(i);
+    REQUIRE(bitmap.FindPrevUnset(128) == npos);
+    REQUIRE(bitmap.FindPrevUnset(129) == 128);
+    REQUIRE(bitmap.FindPrevUnset(132) == 131);
+    bitmap.reset(5);
+    REQUIRE(bitmap.FindPrevUnset(128) == 5);
+    REQUIRE(bitmap.FindPrevUnset(5) == npos);
 }
@@ -1,5 +1,6 @@
 #include "catch.hpp"
 #include "../sparsearray.h"
+#include "counted.h"
 
 TEST_CASE("LinkedListSA: Basic actions", "[LinkedListSA]")
 {
@@ -9,6 +10,47 @@ TEST_CASE("LinkedListSA: Basic actions", "[LinkedListSA]")
 #include "common.h"
 }
 
+TEST_CASE("LinkedListSA: Element lifetime", "[LinkedListSA]")
+{
+    constexpr int N = 10;
+    LinkedListSA<Counted, N> array;
+
+#include "lifetime.h"
+}
+
+TEST_CASE("LinkedListSA: Parallel iteration", "[LinkedListSA]")
+{
+    // Large enough for several tasks.
+    constexpr int N = 10000;
+    LinkedListSA<int, N> array;
+
+#include "parallel.h"
+}
+
+TEST_CASE("LinkedListSA: Compaction", "[LinkedListSA]")
+{
+    constexpr int N = 100;
+    LinkedListSA<Counted, N> array;
+
+#include "compaction.h"
+}
+
+TEST_CASE("LinkedListSA (SplitLayout): Basic actions", "[LinkedListSA]")
+{
+    constexpr int N = 10;
+    LinkedListSA<int, N, SplitLayout> array;
+
+#include "common.h"
+}
+
+TEST_CASE("LinkedListSA (SplitLayout): Element lifetime", "[LinkedListSA]")
+{
+    constexpr int N = 10;
+    LinkedListSA<Counted, N, SplitLayout> array;
+
+#include "lifetime.h"
+}
+
 typedef LinkedListSA<int, 3> LinkedListSAIntThree;
 
 TEST_CASE_METHOD(LinkedListSAIntThree, "LinkedListSA: Internals", "[LinkedListSA]")
@@ -18,26 +60,26 @@ TEST_CASE_METHOD(LinkedListSAIntThree, "LinkedListSA: Internals", "[LinkedListSA
 
     SECTION("New should set pointers correctly")
     {
-        REQUIRE(&firstUsed->data == one);
-        REQUIRE(firstFree == nullptr);
+        REQUIRE(&Data(firstUsed) == one);
+        REQUIRE(firstFree == None);
     }
 
     SECTION("Delete should set pointers correctly")
     {
         Delete(two);
-        REQUIRE(&firstFree->data == two);
-        REQUIRE(firstFree->next == nullptr);
-        REQUIRE(&firstUsed->next->data == three);
+        REQUIRE(&Data(firstFree) == two);
+        REQUIRE(Next(firstFree) == None);
+        REQUIRE(&Data(Next(firstUsed)) == three);
     }
 
     SECTION("out-of-order deletion should set pointers correctly")
     {
         Delete(two); Delete(three); Delete(one);
-        REQUIRE(firstUsed == nullptr);
-        REQUIRE(firstFree->data == 1);
-        REQUIRE(firstFree->next->data == 2);
-        REQUIRE(firstFree->next->next->data == 3);
-        REQUIRE(firstFree->next->next->next == nullptr);
+        REQUIRE(firstUsed == None);
+        REQUIRE(Data(firstFree) == 1);
+        REQUIRE(Data(Next(firstFree)) == 2);
+        REQUIRE(Data(Next(Next(firstFree))) == 3);
+        REQUIRE(Next(Next(Next(firstFree))) == None);
     }
 
     SECTION("insertion should keep order")
@@ -45,7 +87,56 @@ TEST_CASE_METHOD(LinkedListSAIntThree, "LinkedListSA: Internals", "[LinkedListSA
         Delete(three); Delete(one);
         REQUIRE(*New() == 1);
         REQUIRE(*New() == 3);
-        REQUIRE(firstUsed->data == 1);
+        REQUIRE(Data(firstUsed) == 1);
     }
 
 }
+
+TEST_CASE("LinkedListSA: Index width", "[LinkedListSA]")
+{
+    REQUIRE((std::is_same<sa_detail::LinkIndex<10>, uint16_t>::value));
+    REQUIRE((std::is_same<sa_detail::LinkIndex<65535>, uint16_t>::value));
+    REQUIRE((std::is_same<sa_detail::LinkIndex<65536>, uint32_t>::value));
+    // Interleaved links are padded to the element's alignment, separate ones aren't.
+    REQUIRE(sizeof(LinkedListSA<int16_t, 1000>) < sizeof(LinkedListSA<int16_t, 1000, InterleavedLayout, uint32_t>));
+    REQUIRE(sizeof(LinkedListSA<int, 1000, SplitLayout>) < sizeof(LinkedListSA<int, 1000, SplitLayout, uint32_t>));
+}
+
+TEST_CASE("LinkedListSA: Largest array with 16-bit links", "[LinkedListSA]")
+{
+    // The last index is one below the end marker.
+    constexpr size_t N = 65535;
+    std::unique_ptr<LinkedListSA<int, N>> array(new LinkedListSA<int, N>);
+    int *first = nullptr, *last = nullptr;
+    for (size_t i = 0; i < N; i++)
+    {
+        last = array->New();
+        if (!last) break;
+        *last = i;
+        if (!first) first = last;
+    }
+    REQUIRE(last != nullptr);
+    REQUIRE(array->New() == nullptr);
+
+    array->Delete(last);
+    array->Delete(first);
+    REQUIRE(array->Emplace(0) == first);
+    REQUIRE(array->Emplace((int) N - 1) == last);
+    REQUIRE(array->New() == nullptr);
+
+    size_t count = 0;
+    for (int& el : *array)
+        CHECK(el == (int) count++);
+    REQUIRE(count == N);
+}
+
+TEST_CASE("LinkedListSA: Split layout", "[LinkedListSA]")
+{
+    LinkedListSA<int, 10, SplitLayout> array;
+    int *one = array.New(), *two = array.New();
+
+    // The payload is a plain array without links in between.
+    REQUIRE(two == one + 1);
+    array.Delete(one);
+    REQUIRE(array.New() == one);
+}
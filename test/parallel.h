@@ -0,0 +1,102 @@
+/* Tests for ParallelForEach, shared by all SA implementations. N should span several tasks. */
+
+SECTION("parallel iteration should visit every element once")
+{
+	ThreadPool pool(4);
+	for (int i = 0; i < N; i++)
+		*array.New() = i;
+	std::atomic<int> count(0);
+	std::atomic<long> sum(0);
+	array.ParallelForEach([&](int& el)
+	{
+		count++;
+		sum += el;
+		el = -el;
+		return false;
+	}, pool);
+	REQUIRE(count == N);
+	REQUIRE(sum == (long) N * (N - 1) / 2);
+	int i = 0;
+	for (int el : array)
+		CHECK(el == -i++);
+	REQUIRE(i == N);
+}
+
+SECTION("parallel iteration should delete afterwards")
+{
+	ThreadPool pool(4);
+	for (int i = 0; i < N; i++)
+		*array.New() = i;
+	array.ParallelForEach([](int& el) { return el % 3 == 0; }, pool);
+	std::vector<int> remaining;
+	for (int el : array)
+		remaining.push_back(el);
+	std::sort(remaining.begin(), remaining.end());
+	REQUIRE(remaining.size() == (size_t) (N - (N + 2) / 3));
+	int expected = 1;
+	for (int el : remaining)
+	{
+		CHECK(el == expected);
+		expected += expected % 3 == 1 ? 1 : 2;
+	}
+	// The deleted spots can be used again.
+	for (int i = 0; i < (N + 2) / 3; i++)
+		REQUIRE(array.New() != nullptr);
+	REQUIRE(array.New() == nullptr);
+}
+
+SECTION("parallel iteration should work on an empty array")
+{
+	ThreadPool pool(4);
+	array.ParallelForEach([](int&) { FAIL(); return false; }, pool);
+	REQUIRE(array.begin() == array.end());
+}
+
+SECTION("deterministic iteration should not depend on the number of threads")
+{
+	for (int i = 0; i < N; i++)
+		*array.New() = i;
+	// Floating point addition isn't associative, so this also checks the order of combining.
+	double expected = 0;
+	for (size_t threads = 1; threads <= 8; threads++)
+	{
+		ThreadPool pool(threads);
+		double sum = array.DeterministicForEach<double>([](int& el, DeterministicTask<int, double>& task)
+		{
+			task.value += el * 0.1;
+			return false;
+		}, pool);
+		if (threads == 1)
+			expected = sum;
+		CAPTURE(threads);
+		REQUIRE(sum == expected);
+	}
+}
+
+SECTION("deterministic iteration should delete and spawn afterwards")
+{
+	ThreadPool pool(4);
+	for (int i = 0; i < N; i++)
+		*array.New() = i;
+	int deleted = array.DeterministicForEach<int>([](int& el, DeterministicTask<int, int>& task)
+	{
+		if (el % 3)
+			return false;
+		task.value++;
+		if (el % 2 == 0)
+			task.Spawn(-el);
+		return true;
+	}, pool);
+	REQUIRE(deleted == (N + 2) / 3);
+	std::vector<int> remaining, expected;
+	for (int el : array)
+		remaining.push_back(el);
+	for (int i = 0; i < N; i++)
+		if (i % 3)
+			expected.push_back(i);
+		else if (i % 2 == 0)
+			expected.push_back(-i);
+	std::sort(remaining.begin(), remaining.end());
+	std::sort(expected.begin(), expected.end());
+	REQUIRE(remaining == expected);
+}
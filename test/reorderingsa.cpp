@@ -0,0 +1,167 @@
+#include "catch.hpp"
+#include "../sparsearray.h"
+#include "counted.h"
+
+#include <functional>
+#include <map>
+
+TEST_CASE("ReorderingSA: Element lifetime", "[ReorderingSA]")
+{
+    constexpr int N = 10;
+    ReorderingSA<Counted, N> array;
+
+#include "lifetime.h"
+}
+
+TEST_CASE("ReorderingSA: Parallel iteration", "[ReorderingSA]")
+{
+    // Large enough for several tasks.
+    constexpr int N = 10000;
+    ReorderingSA<int, N> array;
+
+#include "parallel.h"
+}
+
+TEST_CASE("ReorderingSA: Relocation", "[ReorderingSA]")
+{
+    constexpr int N = 100;
+    // External index from element value to address, kept up to date by the relocation callback.
+    std::map<int, int*> index;
+    ReorderingSA<int, N, InlineStorage, std::function<void(int*, int*)>> array([&index](int *from, int *to)
+    {
+        REQUIRE(index[*to] == from);
+        index[*to] = to;
+    });
+    for (int i = 0; i < N; i++)
+    {
+        int *el = array.New();
+        *el = i;
+        index[i] = el;
+    }
+    auto check = [&]()
+    {
+        for (int& el : array)
+            REQUIRE(index[el] == &el);
+    };
+
+    SECTION("Delete should report moved elements")
+    {
+        for (int i = 0; i < N; i += 2)
+        {
+            array.Delete(index[i]);
+            index.erase(i);
+        }
+        check();
+        REQUIRE(index.size() == N / 2);
+    }
+
+    SECTION("RemoveIf should report moved elements")
+    {
+        array.RemoveIf([](int el) { return el % 3 == 0; });
+        for (auto it = index.begin(); it != index.end(); )
+            it = it->first % 3 == 0 ? index.erase(it) : std::next(it);
+        check();
+    }
+
+    SECTION("parallel passes should report moved elements")
+    {
+        ThreadPool pool(2);
+        array.ParallelForEach([](int& el) { return el % 4 == 0; }, pool);
+        for (auto it = index.begin(); it != index.end(); )
+            it = it->first % 4 == 0 ? index.erase(it) : std::next(it);
+        check();
+    }
+}
+
+TEST_CASE("ReorderingSA: Relocation and element lifetime", "[ReorderingSA]")
+{
+    constexpr int N = 10;
+    // All paths report a move after the deleted element is gone and the last one moved into its spot.
+    int moves = 0;
+    ReorderingSA<Counted, N, InlineStorage, std::function<void(Counted*, Counted*)>> array([&](Counted *, Counted *to)
+    {
+        CHECK(Counted::Live() == N - 1);
+        CHECK(to->value == N - 1);
+        moves++;
+    });
+    for (int i = 0; i < N; i++)
+        array.Emplace(i);
+    Counted *first = &*array.begin();
+
+    SECTION("Delete")
+    {
+        array.Delete(first);
+    }
+
+    SECTION("RemoveIf")
+    {
+        array.RemoveIf([](Counted& el) { return el.value == 0; });
+    }
+
+    SECTION("Flush")
+    {
+        for (Counted& el : array.Deferred())
+            if (el.value == 0)
+                array.Delete(&el);
+    }
+
+    REQUIRE(moves == 1);
+    REQUIRE(first->value == N - 1);
+    REQUIRE(Counted::Live() == N - 1);
+}
+
+TEST_CASE("ReorderingSA: Deferred deletion", "[ReorderingSA]")
+{
+    constexpr int N = 100;
+    std::map<int, Counted*> index;
+    ReorderingSA<Counted, N, InlineStorage, std::function<void(Counted*, Counted*)>> array([&index](Counted *from, Counted *to)
+    {
+        REQUIRE(index[to->value] == from);
+        index[to->value] = to;
+    });
+    for (int i = 0; i < N; i++)
+        index[i] = array.Emplace(i);
+
+    SECTION("elements should stay in place until the loop ends")
+    {
+        int i = 0;
+        for (Counted& el : array.Deferred())
+        {
+            REQUIRE(el.value == i++);
+            if (el.value % 3 != 1)
+                array.Delete(&el);
+        }
+        REQUIRE(i == N);
+        REQUIRE(Counted::Live() == N / 3);
+        int count = 0;
+        for (Counted& el : array)
+        {
+            REQUIRE(el.value % 3 == 1);
+            REQUIRE(index[el.value] == &el);
+            count++;
+        }
+        REQUIRE(count == N / 3);
+    }
+
+    SECTION("deleting everything should empty the array")
+    {
+        for (Counted& el : array.Deferred())
+            array.Delete(&el);
+        REQUIRE(Counted::Live() == 0);
+        REQUIRE(array.begin() == array.end());
+        REQUIRE(array.New() != nullptr);
+    }
+
+    SECTION("Flush should apply deletions explicitly")
+    {
+        auto range = array.Deferred();
+        array.Delete(index[0]);
+        array.Delete(index[N - 1]);
+        REQUIRE(Counted::Live() == N);
+        array.Flush();
+        REQUIRE(Counted::Live() == N - 2);
+        // Deletions are immediate again.
+        array.Delete(index[1]);
+        REQUIRE(Counted::Live() == N - 3);
+    }
+}